@@ -0,0 +1,689 @@
+/* (c) Peter Chapman 2010
+   Licensed under the GNU General Public Licence; either version 2 or (at your
+   option) any later version
+*/
+
+// Drives the mapping engine from a stream of input events (synthetic, or
+// recorded from a real joystick), without a real joystick or a cuse device,
+// and compares the boost::signals2 model with the FlatMapper built from it.
+// With --read, measures instead what it costs a client to read from a backlog
+// of output events. With --generate, writes out a config that is hard work
+// for the mapping engine.
+
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <iostream>
+#include <algorithm>
+#include <deque>
+#include <boost/lexical_cast.hpp>
+#include "joymodel.h"
+#include "flatmap.h"
+#include "eventring.h"
+#include "recorder.h"
+
+static const char *usage =
+"usage: benchmark [--stream=FILE] [CONFIG [EVENTS [BUTTONS AXES]]]\n"
+"       benchmark --read [READS]\n"
+"       benchmark --parse [MAX]\n"
+"       benchmark --generate=KIND N [BUTTONS AXES]\n"
+"\n"
+"    FILE      input events recorded from a real joystick (eg. with\n"
+"              \"cat /dev/input/js0 > FILE\") instead of random ones\n"
+"    CONFIG    XML configuration file (default x52pro.xml)\n"
+"    EVENTS    number of input events to map (default 1000000, or all of\n"
+"              FILE)\n"
+"    BUTTONS   buttons on the simulated joystick (default 39, or as many as\n"
+"              FILE uses)\n"
+"    AXES      axes on the simulated joystick (default 11, or as many as\n"
+"              FILE uses)\n"
+"    READS     number of reads from each size of backlog (default 100000)\n"
+"    MAX       parse ever larger layers configs until one has this many\n"
+"              virtual buttons (default 10000)\n"
+"    KIND      config to write to stdout:\n"
+"                deep   shifts nested N deep\n"
+"                wide   one shift cycling between N sets\n"
+"                hats   every axis split into buttons, shifted N ways\n"
+"                layers shifts nested N deep in every condition, each\n"
+"                       one named\n"
+"\n";
+
+// Stands in for InputJoystick
+class FakeJoystick : public Joystick
+{
+    std::vector<ButtonPtr> m_buttons;
+    std::vector<AxisPtr>   m_axes;
+    std::vector<js_corr>   m_corr;
+
+public:
+    FakeJoystick(unsigned buttons, unsigned axes)
+        : m_corr(axes, js_corr())
+    {
+        m_name = "Benchmark joystick";
+        for (unsigned i = 0; i < buttons; ++i)
+            m_buttons.push_back(boost::make_shared<Button>(BTN_MISC + i, i));
+        for (unsigned i = 0; i < axes; ++i)
+            m_axes.push_back(boost::make_shared<Axis>(i));
+    }
+
+    virtual unsigned    NumAxes() const { return m_axes.size(); }
+    virtual unsigned    NumButtons() const { return m_buttons.size(); }
+    virtual AxisPtr     GetAxis(unsigned i) const { return m_axes[i]; }
+    virtual ButtonPtr   GetButton(unsigned i) const { return m_buttons[i]; }
+    virtual void GetCorrection(js_corr *corr) const
+    {
+        std::copy(m_corr.begin(), m_corr.end(), corr);
+    }
+    virtual void SetCorrection(const js_corr *corr)
+    {
+        std::copy(corr, corr + m_corr.size(), m_corr.begin());
+    }
+};
+
+// Startup events for every button & axis, followed by random presses,
+// releases and axis movements. Always the same for the same arguments.
+void MakeStream(unsigned buttons, unsigned axes, unsigned count,
+                std::vector<js_event> &stream)
+{
+    static const __s16 axisValues[] = { -32767, -1000, 0, 0, 1000, 32767 };
+    std::vector<__s16> pressed(buttons);
+    __u32 time = 0;
+
+    srand(1);
+    for (unsigned i = 0; i < buttons; ++i)
+    {
+        js_event e = { time, 0, JS_EVENT_BUTTON | JS_EVENT_INIT, __u8(i) };
+        stream.push_back(e);
+    }
+    for (unsigned i = 0; i < axes; ++i)
+    {
+        js_event e = { time, 0, JS_EVENT_AXIS | JS_EVENT_INIT, __u8(i) };
+        stream.push_back(e);
+    }
+    while (stream.size() < count)
+    {
+        time += rand() % 3;
+        js_event e = { time, 0, 0, 0 };
+        if (axes == 0 || rand() % 3)
+        {
+            e.type = JS_EVENT_BUTTON;
+            e.number = rand() % buttons;
+            e.value = pressed[e.number] = !pressed[e.number];
+        }
+        else
+        {
+            e.type = JS_EVENT_AXIS;
+            e.number = rand() % axes;
+            e.value = axisValues[rand() % 6];
+        }
+        stream.push_back(e);
+    }
+}
+
+// Load a file of raw js_events, or a recording made by stickshift --record,
+// dropping any that don't fit a joystick with 'buttons' and 'axes' (where
+// these are zero, they are set to fit the file).
+bool LoadStream(const char *file, unsigned &buttons, unsigned &axes,
+                unsigned count, std::vector<js_event> &stream)
+{
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat s;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &s) == 0 && s.st_size > 0)
+        map = mmap(0, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    
+    const js_event *first = (const js_event *)map;
+    const js_event *last = first + s.st_size / sizeof(js_event);
+    std::vector<js_event> recorded;
+    if (IsRecording(map, s.st_size))
+    {
+        // Only the first device's events: the rest were mapped separately
+        const RecordedEvent *r =
+            (const RecordedEvent *)((const char *)map + sizeof(RecordHeader));
+        const RecordedEvent *end =
+            r + (s.st_size - sizeof(RecordHeader)) / sizeof(RecordedEvent);
+        for (; r != end; ++r)
+            if (r->device == 0)
+                recorded.push_back(r->event);
+        first = recorded.empty() ? 0 : &recorded[0];
+        last = first + recorded.size();
+    }
+    if (count && size_t(last - first) > count)
+        last = first + count;
+    
+    unsigned maxButton = 0, maxAxis = 0;
+    for (const js_event *e = first; e != last; ++e)
+    {
+        if ((e->type & ~JS_EVENT_INIT) == JS_EVENT_BUTTON)
+            maxButton = std::max(maxButton, e->number + 1u);
+        else if ((e->type & ~JS_EVENT_INIT) == JS_EVENT_AXIS)
+            maxAxis = std::max(maxAxis, e->number + 1u);
+    }
+    if (buttons == 0)
+        buttons = maxButton;
+    if (axes == 0)
+        axes = maxAxis;
+    
+    for (const js_event *e = first; e != last; ++e)
+    {
+        if ((e->type & ~JS_EVENT_INIT) == JS_EVENT_BUTTON ?
+                e->number < buttons :
+            (e->type & ~JS_EVENT_INIT) == JS_EVENT_AXIS ?
+                e->number < axes : false)
+        {
+            stream.push_back(*e);
+        }
+    }
+    munmap(map, s.st_size);
+    return true;
+}
+
+// Configs that exercise the worst cases of the mapping engine (or of
+// parsing), for a joystick with 'buttons' and 'axes', written to 'out'
+bool GenerateConfig(FILE *out, const std::string &kind, unsigned n,
+                    unsigned buttons, unsigned axes)
+{
+    if (!(kind == "deep" && buttons >= n + 8) &&
+        !(kind == "wide" && buttons >= 9) &&
+        !(kind == "hats" && buttons >= 1 && axes >= 1) &&
+        !(kind == "layers" && buttons > n && n <= 16))
+    {
+        return false;
+    }
+    
+    fprintf(out, "<stickshift>\n"
+            "    <!-- Written by benchmark: %s config, N=%u, for a joystick"
+            " with\n"
+            "         %u buttons and %u axes -->\n",
+            kind.c_str(), n, buttons, axes);
+    
+    if (kind == "deep")
+    {
+        // 8 buttons shifted by each of buttons 0..n-1 in turn, each shift
+        // nested inside the last: a press travels through up to n shifts
+        fprintf(out, "    <bset begin=\"%u\" end=\"%u\" name=\"data\"/>\n",
+                n, n + 7);
+        for (unsigned i = 0; i < n; ++i)
+        {
+            std::string indent(4 + i * 8, ' ');
+            fprintf(out, "%s<shift>\n"
+                    "%s    <bset use=\"data\"/>\n"
+                    "%s    <condition button=\"%u\" state=\"0\"/>\n"
+                    "%s    <condition button=\"%u\" state=\"1\">\n",
+                    indent.c_str(), indent.c_str(), indent.c_str(), i,
+                    indent.c_str(), i);
+        }
+        for (unsigned i = n; i-- > 0;)
+        {
+            std::string indent(4 + i * 8, ' ');
+            fprintf(out, "%s    </condition>\n"
+                    "%s</shift>\n", indent.c_str(), indent.c_str());
+        }
+    }
+    else if (kind == "wide")
+    {
+        // 8 buttons rotated between n sets by button 0: every press of it
+        // moves all 8
+        fprintf(out, "    <shift>\n"
+                "        <bset begin=\"1\" end=\"8\"/>\n"
+                "        <condition button=\"0\" state=\"1");
+        for (unsigned i = 1; i < n; ++i)
+            fprintf(out, ",1");
+        fprintf(out, "\"/>\n"
+                "    </shift>\n");
+    }
+    else if (kind == "hats")
+    {
+        // Every axis is a pair of buttons, and all of them are shifted n ways
+        // by button 0
+        fprintf(out, "    <bset name=\"hats\">\n");
+        for (unsigned i = 0; i < axes; ++i)
+            fprintf(out, "        <axisbuttons axis=\"%u\"/>\n", i);
+        fprintf(out, "    </bset>\n"
+                "    <shift>\n"
+                "        <bset use=\"hats\"/>\n"
+                "        <condition button=\"0\" state=\"1");
+        for (unsigned i = 1; i < n; ++i)
+            fprintf(out, ",1");
+        fprintf(out, "\"/>\n"
+                "    </shift>\n");
+    }
+    else if (kind == "layers")
+    {
+        // The rest of the buttons shifted 2 ways by each of buttons 0..n-1,
+        // with another shift inside both conditions of every one: 2^n times
+        // as many virtual buttons, and every layer named, as a big cockpit
+        // setup might have
+        fprintf(out, "    <bset begin=\"%u\" end=\"%u\" name=\"data\"/>\n",
+                n, buttons - 1);
+        std::vector<unsigned> path;   // state of each enclosing condition
+        for (;;)
+        {
+            const unsigned depth = path.size();
+            std::string indent(4 + depth * 8, ' ');
+            if (depth < n)
+            {
+                fprintf(out, "%s<shift>\n"
+                        "%s    <bset use=\"data\"/>\n"
+                        "%s    <condition button=\"%u\" state=\"0\""
+                        " name=\"L",
+                        indent.c_str(), indent.c_str(), indent.c_str(),
+                        depth);
+                path.push_back(0);
+                for (unsigned i = 0; i < path.size(); ++i)
+                    fprintf(out, "%u", path[i]);
+                fprintf(out, "\">\n");
+                continue;
+            }
+            
+            // Close conditions until one can move on to state 1
+            while (!path.empty() && path.back() == 1)
+            {
+                path.pop_back();
+                std::string indent(4 + path.size() * 8, ' ');
+                fprintf(out, "%s    </condition>\n"
+                        "%s</shift>\n", indent.c_str(), indent.c_str());
+            }
+            if (path.empty())
+                break;
+            std::string outer(4 + (path.size() - 1) * 8, ' ');
+            path.back() = 1;
+            fprintf(out, "%s    </condition>\n"
+                    "%s    <condition button=\"%u\" state=\"1\" name=\"L",
+                    outer.c_str(), outer.c_str(), unsigned(path.size() - 1));
+            for (unsigned i = 0; i < path.size(); ++i)
+                fprintf(out, "%u", path[i]);
+            fprintf(out, "\">\n");
+        }
+    }
+    
+    fprintf(out, "</stickshift>\n");
+    return true;
+}
+
+// Output of the signals2 model is collected here
+struct Collector
+{
+    std::vector<js_event> &out;
+    Collector(std::vector<js_event> &out) : out(out) {}
+    void Add(__u32 time, __s16 value, __u8 type, bool init, __u8 number)
+    {
+        js_event e = { time, value, __u8(type | (init ? JS_EVENT_INIT : 0)),
+                       number };
+        out.push_back(e);
+    }
+};
+
+struct Result
+{
+    double       seconds;
+    size_t       outputEvents;
+    unsigned long long checksum;
+};
+
+double Now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// 'frames[i]' is the index in 'out' of the first output for input event i.
+// Events from one input are put in presentation order (as they would be by
+// stickshift) so that engines which produce them in a different order agree.
+unsigned long long Checksum(std::vector<js_event> &out,
+                            const std::vector<size_t> &frames)
+{
+    unsigned long long sum = 0xcbf29ce484222325ULL;
+    for (size_t f = 0; f < frames.size(); ++f)
+    {
+        size_t end = f + 1 < frames.size() ? frames[f + 1] : out.size();
+        if (end - frames[f] > 1)
+            SortFrame(&out[frames[f]], &out[0] + end);
+    }
+    for (size_t i = 0; i < out.size(); ++i)
+    {
+        const js_event &e = out[i];
+        unsigned long long v = (unsigned long long)e.time << 32 |
+                               (__u16)e.value << 16 | e.type << 8 | e.number;
+        sum = (sum ^ v) * 0x100000001b3ULL;
+    }
+    return sum;
+}
+
+Result RunSignals(Joystick &in, Joystick &mapped,
+                  const std::vector<js_event> &stream)
+{
+    std::vector<js_event> out;
+    std::vector<size_t> frames;
+    out.reserve(stream.size() * 4);
+    frames.reserve(stream.size());
+    Collector c(out);
+    for (unsigned i = 0; i < mapped.NumButtons(); ++i)
+        mapped.GetButton(i)->Connect(
+            boost::bind(&Collector::Add, &c, _1, _2, JS_EVENT_BUTTON, _3, i));
+    for (unsigned i = 0; i < mapped.NumAxes(); ++i)
+        mapped.GetAxis(i)->Connect(
+            boost::bind(&Collector::Add, &c, _1, _2, JS_EVENT_AXIS, _3, i));
+
+    Result r;
+    double start = Now();
+    for (size_t i = 0; i < stream.size(); ++i)
+    {
+        const js_event &e = stream[i];
+        bool init = e.type & JS_EVENT_INIT;
+        frames.push_back(out.size());
+        if ((e.type & ~JS_EVENT_INIT) == JS_EVENT_BUTTON)
+            in.GetButton(e.number)->Input(e.time, e.value, init);
+        else
+            in.GetAxis(e.number)->Input(e.time, e.value, init);
+    }
+    r.seconds = Now() - start;
+    r.outputEvents = out.size();
+    r.checksum = Checksum(out, frames);
+    return r;
+}
+
+Result RunFlat(FlatMapper &flat, const std::vector<js_event> &stream)
+{
+    std::vector<js_event> out;
+    std::vector<size_t> frames;
+    out.reserve(stream.size() * 4);
+    frames.reserve(stream.size());
+
+    Result r;
+    double start = Now();
+    for (size_t i = 0; i < stream.size(); ++i)
+    {
+        frames.push_back(out.size());
+        flat.Input(stream[i], out);
+    }
+    r.seconds = Now() - start;
+    r.outputEvents = out.size();
+    r.checksum = Checksum(out, frames);
+    return r;
+}
+
+void Report(const char *engine, const Result &r, size_t inputEvents)
+{
+    printf("%-8s %10zu in %10zu out %8.1f ns/event %12.0f events/s  "
+           "checksum %016llx\n",
+           engine, inputEvents, r.outputEvents,
+           r.seconds * 1e9 / inputEvents, inputEvents / r.seconds,
+           r.checksum);
+}
+
+// A client reading 'readSize' events at a time from a backlog that stays at
+// 'backlog' events. "queue" is what stickshift used to do: sort a per-client
+// deque on every read, then copy out of it. "ring" reads from an EventRing.
+void ReadBenchmark(unsigned reads)
+{
+    const __u32 readSize = 8, ringSize = 4096;
+    static const __u32 backlogs[] = { 64, 512, 4096 };
+    std::vector<js_event> source;
+    MakeStream(39, 11, ringSize * 2, source);
+    
+    for (unsigned b = 0; b < sizeof(backlogs)/sizeof(backlogs[0]); ++b)
+    {
+        const __u32 backlog = backlogs[b];
+        size_t next = 0;
+        
+        std::deque<js_event> queue(&source[0], &source[0] + backlog);
+        double start = Now();
+        for (unsigned i = 0; i < reads; ++i)
+        {
+            std::stable_sort(queue.begin(), queue.end(), EventOrder());
+            std::vector<js_event> buf(queue.begin(), queue.begin() + readSize);
+            queue.erase(queue.begin(), queue.begin() + readSize);
+            for (__u32 j = 0; j < readSize; ++j)
+                queue.push_back(source[next++ % source.size()]);
+        }
+        double queueTime = Now() - start;
+        
+        EventRing ring(ringSize);
+        ring.Publish(&source[0], backlog);
+        __u32 cursor = 0;
+        js_event buf[readSize];
+        next = 0;
+        start = Now();
+        for (unsigned i = 0; i < reads; ++i)
+        {
+            ring.Read(cursor, buf, readSize);
+            ring.Publish(&source[next], readSize);
+            next = (next + readSize) % (source.size() - readSize);
+        }
+        double ringTime = Now() - start;
+        
+        printf("backlog %5u  queue %8.1f ns/read  ring %8.1f ns/read\n",
+               backlog, queueTime * 1e9 / reads, ringTime * 1e9 / reads);
+    }
+}
+
+// Time loading a "layers" config with 'n' levels for a joystick with
+// 'buttons' buttons, and report how long it takes per virtual button.
+// Returns the number of virtual buttons.
+unsigned ParseConfig(const char *path, unsigned n, unsigned buttons)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return 0;
+    GenerateConfig(f, "layers", n, buttons, 0);
+    fclose(f);
+    
+    // The parser is chatty
+    std::streambuf *err = std::cerr.rdbuf(0);
+    JoystickPtr in(new FakeJoystick(buttons, 0));
+    unsigned outButtons = 0, runs = 0;
+    double parseTime = 0, lowerTime = 0;
+    do
+    {
+        double start = Now();
+        MappedJoystick mapped(in, path, 0);
+        double parsed = Now();
+        MapTables tables;
+        mapped.Lower(tables);
+        lowerTime += Now() - parsed;
+        parseTime += parsed - start;
+        outButtons = mapped.NumButtons();
+        ++runs;
+    } while (parseTime + lowerTime < 0.2);
+    std::cerr.rdbuf(err);
+    std::cerr.clear();
+    
+    printf("N=%-2u %5u buttons in %6u out  parse %9.3f ms (%5.2f us/button)"
+           "  lower %8.3f ms\n", n, buttons, outButtons,
+           parseTime * 1e3 / runs, parseTime * 1e6 / runs / outButtons,
+           lowerTime * 1e3 / runs);
+    fflush(stdout);
+    return outButtons;
+}
+
+// Time loading "layers" configs of increasing size, to show how parsing
+// scales with the number of virtual buttons: first ever deeper, then ever
+// wider
+void ParseBenchmark(unsigned maxButtons)
+{
+    char path[] = "/tmp/benchmark-XXXXXX.xml";
+    int fd = mkstemps(path, 4);
+    if (fd < 0)
+    {
+        std::cerr << "Can't create temporary file\n";
+        return;
+    }
+    close(fd);
+    
+    for (unsigned n = 1; n <= 16; ++n)
+        if (ParseConfig(path, n, n + 32) >= maxButtons)
+            break;
+    printf("\n");
+    for (unsigned width = 32; width <= maxButtons; width *= 2)
+        if (ParseConfig(path, 2, width + 2) >= maxButtons)
+            break;
+    unlink(path);
+}
+
+int main(int argc, char **argv)
+{
+    using boost::lexical_cast;
+    std::vector<std::string> args(argv + 1, argv + argc);
+    const char *config = "x52pro.xml";
+    std::string streamFile;
+    unsigned events = 0, buttons = 0, axes = 0, n = 0;
+
+    if (!args.empty() && args[0] == "--read")
+    {
+        unsigned reads = 100000;
+        try {
+            if (args.size() > 1)
+                reads = lexical_cast<unsigned>(args[1]);
+        } catch (const boost::bad_lexical_cast &) {
+            reads = 0;
+        }
+        if (args.size() > 2 || reads == 0)
+        {
+            std::cerr << usage;
+            return 1;
+        }
+        ReadBenchmark(reads);
+        return 0;
+    }
+    
+    if (!args.empty() && args[0] == "--parse")
+    {
+        unsigned max = 10000;
+        try {
+            if (args.size() > 1)
+                max = lexical_cast<unsigned>(args[1]);
+        } catch (const boost::bad_lexical_cast &) {
+            max = 0;
+        }
+        if (args.size() > 2 || max == 0)
+        {
+            std::cerr << usage;
+            return 1;
+        }
+        ParseBenchmark(max);
+        return 0;
+    }
+    
+    if (!args.empty() && args[0].compare(0, 11, "--generate=") == 0)
+    {
+        buttons = 39;
+        axes = 11;
+        try {
+            if (args.size() > 1)
+                n = lexical_cast<unsigned>(args[1]);
+            if (args.size() == 4)
+            {
+                buttons = lexical_cast<unsigned>(args[2]);
+                axes = lexical_cast<unsigned>(args[3]);
+            }
+        } catch (const boost::bad_lexical_cast &) {
+            n = 0;
+        }
+        if ((args.size() != 2 && args.size() != 4) || n == 0 ||
+            !GenerateConfig(stdout, args[0].substr(11), n, buttons, axes))
+        {
+            std::cerr << usage;
+            return 1;
+        }
+        return 0;
+    }
+    
+    if (!args.empty() && args[0].compare(0, 9, "--stream=") == 0)
+    {
+        streamFile = args[0].substr(9);
+        args.erase(args.begin());
+    }
+
+    try {
+        if (args.size() > 0)
+            config = argv[argc - args.size()];
+        if (args.size() > 1)
+            events = lexical_cast<unsigned>(args[1]);
+        if (args.size() > 3)
+        {
+            buttons = lexical_cast<unsigned>(args[2]);
+            axes = lexical_cast<unsigned>(args[3]);
+        }
+    } catch (const boost::bad_lexical_cast &) {
+        std::cerr << usage;
+        return 1;
+    }
+    if (args.size() > 4 || args.size() == 3 || (args.size() == 4 && !buttons))
+    {
+        std::cerr << usage;
+        return 1;
+    }
+
+    std::vector<js_event> stream;
+    if (streamFile.empty())
+    {
+        if (args.size() < 4)
+        {
+            buttons = 39;
+            axes = 11;
+        }
+        MakeStream(buttons, axes, events ? events : 1000000, stream);
+    }
+    else if (!LoadStream(streamFile.c_str(), buttons, axes, events, stream))
+    {
+        std::cerr << "Can't read " << streamFile << '\n';
+        return 1;
+    }
+    if (stream.empty() || buttons == 0)
+    {
+        std::cerr << "No input events to map\n";
+        return 1;
+    }
+
+    try {
+        // All engines must come from the same model: output button numbers
+        // can differ between two parses of the same config.
+        JoystickPtr in(new FakeJoystick(buttons, axes));
+        MappedJoystick mapped(in, config, 0);
+        MapTables tables;
+        mapped.Lower(tables);
+        FlatMapper flatMapper(tables, buttons, axes);
+        FlatMapper treeMapper(tables, buttons, axes, true);
+        
+        Result sig = RunSignals(*in, mapped, stream);
+        Result flat = RunFlat(flatMapper, stream);
+        Result tree = RunFlat(treeMapper, stream);
+
+        printf("%s: %u buttons, %u axes in; %u buttons, %u axes out\n",
+               config, buttons, axes, mapped.NumButtons(), mapped.NumAxes());
+        Report("signals2", sig, stream.size());
+        Report("flat", flat, stream.size());
+        Report("flatten", tree, stream.size());
+        printf("speedup  %.2fx (flatten %.2fx, %u of %u shifts flattened)\n",
+               sig.seconds / flat.seconds, sig.seconds / tree.seconds,
+               treeMapper.NumFlattened(), treeMapper.NumShifts());
+
+        if (sig.checksum != flat.checksum ||
+            sig.outputEvents != flat.outputEvents)
+        {
+            std::cerr << "output of flat mapper differs\n";
+            return 1;
+        }
+        if (sig.checksum != tree.checksum ||
+            sig.outputEvents != tree.outputEvents)
+        {
+            std::cerr << "output of flattened shifts differs\n";
+            return 1;
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,162 @@
+#if !defined(INCLUDED_EVENTRING_H_)
+#define INCLUDED_EVENTRING_H_
+
+/* (c) Peter Chapman 2010
+   Licensed under the GNU General Public Licence; either version 2 or (at your
+   option) any later version
+*/
+
+#include <linux/joystick.h>
+#include <sys/uio.h>
+#include <vector>
+#include <algorithm>
+
+// A fixed-size ring of output events, written by one thread and read by any
+// number of readers, each of which keeps its own cursor (the sequence number
+// of the next event it wants). Neither side takes a lock.
+//
+// The writer never waits for readers: a reader that falls more than
+// Capacity() events behind loses the oldest ones.
+class EventRing
+{
+public:
+    // When an event was read from the real joystick, mapped & published, on
+    // the MonotonicNs() clock
+    struct Stamp
+    {
+        __u64 read, mapped, published;
+    };
+    
+private:
+    std::vector<js_event> m_events;
+    std::vector<Stamp>    m_stamps; // parallel to m_events
+    __u32                 m_mask;
+
+    // Sequence numbers: events before m_head can be read. Events before
+    // m_claim may be being overwritten by the writer.
+    volatile __u32        m_head;
+    volatile __u32        m_claim;
+    
+    // Most events the writer has published at once
+    volatile __u32        m_maxBatch;
+
+public:
+    // 'capacity' is rounded up to a power of 2
+    explicit EventRing(__u32 capacity)
+        : m_head(0),
+          m_claim(0),
+          m_maxBatch(0)
+    {
+        __u32 size = 1;
+        while (size < capacity)
+            size <<= 1;
+        m_events.resize(size);
+        m_stamps.resize(size);
+        m_mask = size - 1;
+    }
+
+    __u32 Capacity() const { return m_mask + 1; }
+
+    // Sequence number of the next event to be written. A new reader starts
+    // here.
+    __u32 Head() const { return m_head; }
+
+    bool Available(__u32 cursor) const { return m_head != cursor; }
+    
+    // Stamp of an event that's been read. Like the event, it may have been
+    // overwritten since.
+    const Stamp &StampAt(__u32 seq) const { return m_stamps[seq & m_mask]; }
+
+    // Writer only: append 'n' events (and their stamps, if given) and make
+    // them visible to readers
+    void Publish(const js_event *events, __u32 n, const Stamp *stamps = 0)
+    {
+        const __u32 head = m_head;
+        if (n > m_maxBatch)
+            m_maxBatch = n;
+        m_claim = head + n;
+        __sync_synchronize();   // readers must see the claim before the data
+        for (__u32 i = 0; i < n; ++i)
+            m_events[(head + i) & m_mask] = events[i];
+        for (__u32 i = 0; stamps && i < n; ++i)
+            m_stamps[(head + i) & m_mask] = stamps[i];
+        __sync_synchronize();   // ... and the data before the new head
+        m_head = head + n;
+    }
+
+    // Copy up to 'max' events, starting at 'cursor', to 'out' and advance
+    // 'cursor' past them. Returns number of events copied.
+    __u32 Read(__u32 &cursor, js_event *out, __u32 max) const
+    {
+        for (;;)
+        {
+            const __u32 head = m_head;
+            __sync_synchronize();
+            if (head - cursor > Capacity())
+                cursor = head - Capacity(); // overrun: skip what we've lost
+
+            const __u32 n = std::min(head - cursor, max);
+            for (__u32 i = 0; i < n; ++i)
+                out[i] = m_events[(cursor + i) & m_mask];
+
+            // If the writer has started on any of the slots we've just
+            // copied, they may be torn - drop them and go round again
+            __sync_synchronize();
+            const __u32 claim = m_claim;
+            if (claim - cursor <= Capacity())
+            {
+                cursor += n;
+                return n;
+            }
+            cursor = claim - Capacity();
+        }
+    }
+
+    // Zero-copy alternative to Read. Points 'segs' (at most 2 of them, in
+    // 'numSegs') at up to 'max' events starting at 'cursor' and returns how
+    // many there are; advance 'cursor' yourself once they've been used.
+    // Returns 0 if the events are near enough to being overwritten that the
+    // writer might get to them while they're in use: Read() them instead.
+    // That's if it could do so in fewer than PEEK_BATCHES of the largest
+    // batches it has published, or in less than half a ring, so a small ring
+    // or a big batch (such as a reload's) makes readers copy.
+    //
+    // That's only a guess: nothing stops the writer lapping a reader that
+    // gets descheduled while using the events. So once they've been used,
+    // ask Overwritten(cursor) and treat it as an overrun if it says so.
+    static const __u32 PEEK_BATCHES = 4;
+    __u32 Peek(__u32 cursor, __u32 max, iovec *segs, int &numSegs) const
+    {
+        const __u32 head = m_head;
+        __sync_synchronize();
+        const __u32 room = Capacity() - std::min(head - cursor, Capacity());
+        if (room < Capacity() / 2 || room / PEEK_BATCHES < m_maxBatch)
+            return 0;
+        
+        const __u32 n = std::min(head - cursor, max);
+        const __u32 first = cursor & m_mask;
+        const __u32 part = std::min(n, Capacity() - first);
+        numSegs = 0;
+        if (part)
+        {
+            segs[numSegs].iov_base = (void *)&m_events[first];
+            segs[numSegs++].iov_len = part * sizeof(js_event);
+        }
+        if (n > part)
+        {
+            segs[numSegs].iov_base = (void *)&m_events[0];
+            segs[numSegs++].iov_len = (n - part) * sizeof(js_event);
+        }
+        return n;
+    }
+    
+    // Has the writer started on the slot of event 'seq' (or any after it)
+    // since it was published?
+    bool Overwritten(__u32 seq) const
+    {
+        __sync_synchronize();   // after whatever used the events
+        return m_claim - seq > Capacity();
+    }
+};
+
+#endif
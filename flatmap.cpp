@@ -0,0 +1,518 @@
+/* (c) Peter Chapman 2010
+   Licensed under the GNU General Public Licence; either version 2 or (at your
+   option) any later version
+*/
+#include "flatmap.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+const __u32 FlatMapper::NO_NODE;
+const __u32 FlatMapper::NO_TREE;
+
+FlatMapper::FlatMapper(const MapTables &t, unsigned inputButtons,
+                       unsigned inputAxes, bool flatten)
+    : m_nodes(t.nodes.size(), Node()),
+      m_inputButtons(inputButtons, NO_NODE),
+      m_inputAxes(inputAxes, AxisState())
+{
+    ActionLists nodeActions(t.nodes.size()), axisActions(inputAxes);
+    const std::runtime_error bad("inconsistent mapping tables");
+
+    // Actions are added in the order the equivalent signals get connected
+    // when a MappedJoystick is built from the same tables
+    for (unsigned n = 0; n < t.nodes.size(); ++n)
+    {
+        const MapTables::Node &node = t.nodes[n];
+        if (node.kind == MapTables::NODE_INPUT && node.index < inputButtons)
+            m_inputButtons[node.index] = n;
+        else if (node.kind == MapTables::NODE_HAT)
+        {
+            if (node.index >= inputAxes)
+                throw bad;
+            Action a = { OP_HAT, node.positive, 0, n, 0 };
+            axisActions[node.index].push_back(a);
+        }
+    }
+
+    for (unsigned s = 0; s < t.shifts.size(); ++s)
+    {
+        const MapTables::Shift &shift = t.shifts[s];
+        Shift fs = { 0, shift.numConditions, shift.numInputs,
+                     (__u32)m_outputs.size(), (__u32)m_pressed.size(),
+                     NO_TREE, 0, 0 };
+        m_shifts.push_back(fs);
+        m_pressed.resize(m_pressed.size() +
+                         (shift.numInputs + WORD_BITS - 1) / WORD_BITS, 0);
+        m_unsettled.resize(m_pressed.size(), 0);
+        for (unsigned i = 0; i < shift.numInputs; ++i)
+            m_unsettled[fs.firstWord + i / WORD_BITS] |=
+                Word(1) << (i % WORD_BITS);
+
+        for (unsigned i = 0; i < shift.numInputs; ++i)
+        {
+            Action a = { OP_SHIFT_INPUT, 0, 0, s, i };
+            nodeActions.at(t.shiftInputs.at(shift.firstInput + i)).push_back(a);
+        }
+
+        // Conditions on the same button & state form one rotation group
+        std::vector<std::vector<__u32> > groupSets;
+        std::map<std::pair<__u32, __s16>, unsigned> groupOf;
+        for (unsigned c = 0; c < shift.numConditions; ++c)
+        {
+            const MapTables::Condition &cond =
+                t.conditions.at(shift.firstCondition + c);
+            for (unsigned i = 0; i < shift.numInputs; ++i)
+                m_outputs.push_back(t.conditionOutputs.at(cond.firstOutput+i));
+
+            std::pair<__u32, __s16> key(cond.button, cond.state);
+            if (groupOf.find(key) == groupOf.end())
+            {
+                groupOf[key] = groupSets.size();
+                groupSets.push_back(std::vector<__u32>());
+                Action a = { OP_SHIFT_CONDITION, 0, cond.state,
+                             (__u32)(m_groups.size() + groupOf[key]), 0 };
+                nodeActions.at(cond.button).push_back(a);
+            }
+            groupSets[groupOf[key]].push_back(c);
+        }
+        for (unsigned g = 0; g < groupSets.size(); ++g)
+        {
+            Group group = { s, (__u32)m_groupSets.size(),
+                            (__u32)groupSets[g].size(), 0 };
+            m_groups.push_back(group);
+            m_groupSets.insert(m_groupSets.end(), groupSets[g].begin(),
+                               groupSets[g].end());
+        }
+    }
+
+    for (unsigned i = 0; i < t.buttons.size(); ++i)
+    {
+        Action a = { OP_EMIT_BUTTON, 0, 0, i, 0 };
+        nodeActions.at(t.buttons[i]).push_back(a);
+    }
+    m_buttons = t.buttons;
+
+    for (unsigned i = 0; i < t.axes.size(); ++i)
+    {
+        Action a = { OP_EMIT_AXIS, 0, 0, i, 0 };
+        axisActions.at(t.axes[i]).push_back(a);
+    }
+    m_axes = t.axes;
+    
+    if (flatten)
+        Flatten(t, nodeActions);
+
+    // Lay all action lists out end to end
+    for (unsigned n = 0; n < m_nodes.size(); ++n)
+    {
+        m_nodes[n].firstAction = m_actions.size();
+        m_nodes[n].numActions = nodeActions[n].size();
+        m_actions.insert(m_actions.end(), nodeActions[n].begin(),
+                         nodeActions[n].end());
+    }
+    for (unsigned i = 0; i < m_inputAxes.size(); ++i)
+    {
+        m_inputAxes[i].firstAction = m_actions.size();
+        m_inputAxes[i].numActions = axisActions[i].size();
+        m_actions.insert(m_actions.end(), axisActions[i].begin(),
+                         axisActions[i].end());
+    }
+}
+
+void FlatMapper::Flatten(const MapTables &t, ActionLists &nodeActions)
+{
+    // A button can only be routed to if nothing else feeds it
+    std::vector<unsigned> outputUses(m_nodes.size(), 0);
+    for (unsigned i = 0; i < m_outputs.size(); ++i)
+        ++outputUses.at(m_outputs[i]);
+    
+    // Collect the shifts in each tree. One that's reached twice can't be
+    // given a single place in a tree's state.
+    std::vector<unsigned> seen(m_shifts.size(), 0);
+    std::vector<std::vector<__u32> > trees;
+    for (unsigned r = 0; r < t.rootShifts.size(); ++r)
+    {
+        std::vector<__u32> shifts(1, t.rootShifts[r]);
+        for (unsigned i = 0; i < shifts.size(); ++i)
+        {
+            if (shifts[i] >= m_shifts.size())
+                throw std::runtime_error("inconsistent mapping tables");
+            if (seen[shifts[i]]++)
+                continue;
+            const MapTables::Shift &shift = t.shifts[shifts[i]];
+            for (unsigned c = 0; c < shift.numConditions; ++c)
+            {
+                const MapTables::Condition &cond =
+                    t.conditions[shift.firstCondition + c];
+                for (unsigned j = 0; j < cond.numSubs; ++j)
+                    shifts.push_back(t.subShifts.at(cond.firstSub + j));
+            }
+        }
+        trees.push_back(shifts);
+    }
+    
+    for (unsigned i = 0; i < trees.size(); ++i)
+    {
+        bool once = true;
+        for (unsigned j = 0; j < trees[i].size(); ++j)
+            once = once && seen[trees[i][j]] == 1;
+        if (once)
+            FlattenTree(t, trees[i], nodeActions, outputUses);
+    }
+}
+
+bool FlatMapper::FlattenTree(const MapTables &t,
+                             const std::vector<__u32> &shifts,
+                             ActionLists &nodeActions,
+                             const std::vector<unsigned> &outputUses)
+{
+    // Every output of the tree must either go straight to output buttons, or
+    // be the input of a subshift of its condition and nothing else
+    std::vector<bool> inner(m_nodes.size(), false);
+    unsigned long long numStates = 1;
+    for (unsigned k = 0; k < shifts.size(); ++k)
+    {
+        const Shift &s = m_shifts[shifts[k]];
+        const MapTables::Shift &shift = t.shifts[shifts[k]];
+        for (unsigned c = 0; c < s.numSets; ++c)
+        {
+            const MapTables::Condition &cond =
+                t.conditions[shift.firstCondition + c];
+            std::vector<__u32>::const_iterator
+                subs = t.subShifts.begin() + cond.firstSub,
+                subsEnd = subs + cond.numSubs;
+            for (unsigned i = 0; i < s.numInputs; ++i)
+            {
+                const __u32 n = m_outputs[s.firstOutput + c * s.numInputs + i];
+                const std::vector<Action> &actions = nodeActions[n];
+                if (outputUses[n] != 1 ||
+                    t.nodes[n].kind != MapTables::NODE_SHIFTED)
+                {
+                    return false;
+                }
+                if (actions.size() == 1 && actions[0].op == OP_SHIFT_INPUT)
+                {
+                    if (std::find(subs, subsEnd, actions[0].a) == subsEnd)
+                        return false;
+                    inner[n] = true;
+                }
+                for (unsigned a = 0; !inner[n] && a < actions.size(); ++a)
+                    if (actions[a].op != OP_EMIT_BUTTON)
+                        return false;
+            }
+        }
+        numStates *= std::max(s.numSets, __u32(1));
+        if (numStates > MAX_ROUTES)
+            return false;
+    }
+    
+    // Inputs from outside the tree
+    std::vector<std::pair<__u32, __u32> > columns;
+    for (unsigned k = 0; k < shifts.size(); ++k)
+    {
+        const MapTables::Shift &shift = t.shifts[shifts[k]];
+        for (unsigned i = 0; i < shift.numInputs; ++i)
+            if (!inner[t.shiftInputs[shift.firstInput + i]])
+                columns.push_back(std::make_pair(shifts[k], i));
+    }
+    if (numStates * columns.size() > MAX_ROUTES)
+        return false;
+    
+    const __u32 id = m_trees.size();
+    Tree tree = { 0, (__u32)columns.size(), (__u32)m_columns.size(),
+                  (__u32)m_routes.size(), (__u32)m_live.size() };
+    m_trees.push_back(tree);
+    
+    __u32 radix = 1;
+    for (unsigned k = 0; k < shifts.size(); ++k)
+    {
+        Shift &s = m_shifts[shifts[k]];
+        s.tree = id;
+        s.radix = radix;
+        radix *= std::max(s.numSets, __u32(1));
+    }
+    
+    m_live.resize(m_live.size() + (columns.size() + WORD_BITS - 1) / WORD_BITS,
+                  0);
+    for (unsigned c = 0; c < columns.size(); ++c)
+    {
+        m_live[tree.firstWord + c / WORD_BITS] |= Word(1) << (c % WORD_BITS);
+        
+        // Send the column's input through the tree instead
+        const __u32 shift = columns[c].first, slot = columns[c].second;
+        std::vector<Action> &actions =
+            nodeActions[t.shiftInputs[t.shifts[shift].firstInput + slot]];
+        for (unsigned a = 0; a < actions.size(); ++a)
+        {
+            if (actions[a].op == OP_SHIFT_INPUT && actions[a].a == shift &&
+                actions[a].b == slot)
+            {
+                actions[a].op = OP_ROUTE;
+                actions[a].a = id;
+                actions[a].b = c;
+            }
+        }
+        
+        // Every button it can end up at, for JS_EVENT_INIT
+        Column col = { (__u32)m_leaves.size(), 0, 0, 0, 0 };
+        std::vector<std::pair<__u32, __u32> > todo(1, columns[c]);
+        while (!todo.empty())
+        {
+            const Shift &s = m_shifts[todo.back().first];
+            const __u32 i = todo.back().second;
+            todo.pop_back();
+            for (__u32 set = 0; set < s.numSets; ++set)
+            {
+                const __u32 n =
+                    m_outputs[s.firstOutput + set * s.numInputs + i];
+                if (inner[n])
+                    todo.push_back(std::make_pair(nodeActions[n][0].a,
+                                                  nodeActions[n][0].b));
+                else
+                    m_leaves.push_back(n);
+            }
+        }
+        col.numLeaves = m_leaves.size() - col.firstLeaf;
+        m_columns.push_back(col);
+    }
+    
+    // Where each column ends up in each state
+    for (__u32 state = 0; state < numStates; ++state)
+    {
+        for (unsigned c = 0; c < columns.size(); ++c)
+        {
+            __u32 shift = columns[c].first, slot = columns[c].second;
+            __u32 n = NO_NODE;
+            for (;;)
+            {
+                const Shift &s = m_shifts[shift];
+                if (s.numSets == 0)
+                {
+                    n = NO_NODE;
+                    break;
+                }
+                const __u32 set = state / s.radix % s.numSets;
+                n = m_outputs[s.firstOutput + set * s.numInputs + slot];
+                if (!inner[n])
+                    break;
+                shift = nodeActions[n][0].a;
+                slot = nodeActions[n][0].b;
+            }
+            m_routes.push_back(n);
+        }
+    }
+    return true;
+}
+
+unsigned FlatMapper::NumFlattened() const
+{
+    unsigned n = 0;
+    for (unsigned s = 0; s < m_shifts.size(); ++s)
+        if (m_shifts[s].tree != NO_TREE)
+            ++n;
+    return n;
+}
+
+void FlatMapper::Input(const js_event &e, std::vector<js_event> &out)
+{
+    bool init = e.type & JS_EVENT_INIT;
+    switch (e.type & ~JS_EVENT_INIT)
+    {
+    case JS_EVENT_BUTTON:
+        if (e.number < m_inputButtons.size() &&
+            m_inputButtons[e.number] != NO_NODE)
+        {
+            NodeInput(m_inputButtons[e.number], e.time, e.value, init, out);
+        }
+        break;
+    case JS_EVENT_AXIS:
+        if (e.number < m_inputAxes.size())
+        {
+            // Same as Axis::Input
+            AxisState &axis = m_inputAxes[e.number];
+            if (init)
+                axis.value = e.value;
+            else if (e.value == axis.value)
+                break;
+            Fire(axis.firstAction, axis.numActions, e.time, e.value, init,
+                 out);
+            axis.value = e.value;
+        }
+        break;
+    }
+}
+
+void FlatMapper::NodeInput(__u32 node, __u32 time, __s16 value, bool init,
+                           std::vector<js_event> &out)
+{
+    // Same as Button::Input
+    Node &n = m_nodes[node];
+    if (!n.initialised)
+    {
+        n.value = value;
+        n.initialised = 1;
+    }
+    else if (value == n.value)
+        return;
+
+    Fire(n.firstAction, n.numActions, time, value, init, out);
+    n.value = value;
+}
+
+void FlatMapper::Fire(__u32 first, __u32 num, __u32 time, __s16 value,
+                      bool init, std::vector<js_event> &out)
+{
+    const __u8 initFlag = init ? JS_EVENT_INIT : 0;
+    for (__u32 i = first; i < first + num; ++i)
+    {
+        const Action &a = m_actions[i];
+        switch (a.op)
+        {
+        case OP_EMIT_BUTTON: {
+            js_event e = { time, value, __u8(JS_EVENT_BUTTON | initFlag),
+                           __u8(a.a) };
+            out.push_back(e);
+            break;
+        }
+        case OP_EMIT_AXIS: {
+            js_event e = { time, value, __u8(JS_EVENT_AXIS | initFlag),
+                           __u8(a.a) };
+            out.push_back(e);
+            break;
+        }
+        case OP_HAT:
+            NodeInput(a.a, time, (a.positive ? value : -value) > 0 ? 1 : 0,
+                      init, out);
+            break;
+        case OP_SHIFT_INPUT: {
+            // Same as ShiftSet::Input
+            const Shift &s = m_shifts[a.a];
+            if (s.currentSet >= s.numSets)
+                break;
+            const __u32 *outputs = &m_outputs[s.firstOutput + a.b];
+            NodeInput(outputs[s.currentSet * s.numInputs], time, value, init,
+                      out);
+            if (init)
+                for (__u32 j = 0; j < s.numSets; ++j)
+                    if (j != s.currentSet)
+                        NodeInput(outputs[j * s.numInputs], time, 0, init,
+                                  out);
+            
+            const __u32 word = s.firstWord + a.b / WORD_BITS;
+            const Word bit = Word(1) << (a.b % WORD_BITS);
+            if (value)
+                m_pressed[word] |= bit;
+            else
+                m_pressed[word] &= ~bit;
+            if (init)
+                m_unsettled[word] &= ~bit;
+            break;
+        }
+        case OP_SHIFT_CONDITION:
+            if (value == a.test)
+                ShiftInput(a.a, time, init, out);
+            break;
+        case OP_ROUTE:
+            RouteInput(a.a, a.b, time, value, init, out);
+            break;
+        }
+    }
+}
+
+void FlatMapper::ShiftInput(__u32 group, __u32 time, bool init,
+                            std::vector<js_event> &out)
+{
+    // Same as ShiftSet::ShiftInput
+    Group &g = m_groups[group];
+    g.head = (g.head + 1) % g.numSets;
+    const __u32 newSet = m_groupSets[g.firstSet + g.head];
+
+    Shift &s = m_shifts[g.shift];
+    if (s.currentSet == newSet)
+        return; // already selected - nothing to do
+    if (s.tree != NO_TREE)
+    {
+        TreeShift(g.shift, newSet, time, init, out);
+        return;
+    }
+
+    // Copy values of previously selected buttons to the newly selected
+    // buttons, and set the former to 0. Released inputs have nothing to copy.
+    const __u32 *from = &m_outputs[s.firstOutput + s.currentSet * s.numInputs];
+    const __u32 *to   = &m_outputs[s.firstOutput + newSet * s.numInputs];
+    const __u32 numWords = (s.numInputs + WORD_BITS - 1) / WORD_BITS;
+    for (__u32 w = 0; w < numWords; ++w)
+    {
+        const __u32 word = s.firstWord + w;
+        for (Word bits = m_pressed[word] | m_unsettled[word]; bits;
+             bits &= bits - 1)
+        {
+            __u32 i = w * WORD_BITS + __builtin_ctzl(bits);
+            if (from[i] == to[i])
+                continue;
+            __s16 oldval = m_nodes[from[i]].value;
+            NodeInput(from[i], time, 0, init, out);
+            NodeInput(to[i], time, oldval, init, out);
+        }
+    }
+    s.currentSet = newSet;
+    ++s.switches;
+}
+
+void FlatMapper::RouteInput(__u32 tree, __u32 column, __u32 time, __s16 value,
+                            bool init, std::vector<js_event> &out)
+{
+    // Same as ShiftSet::Input on each shift down the tree
+    const Tree &t = m_trees[tree];
+    Column &c = m_columns[t.firstColumn + column];
+    const __u32 to = m_routes[t.firstRoute + t.state * t.numColumns + column];
+    if (to != NO_NODE)
+        NodeInput(to, time, value, init, out);
+    
+    // The others in every shift below get 0, whether selected or not
+    if (init)
+    {
+        for (__u32 i = c.firstLeaf; i < c.firstLeaf + c.numLeaves; ++i)
+            if (m_leaves[i] != to)
+                NodeInput(m_leaves[i], time, 0, init, out);
+        c.settled = 1;
+    }
+    
+    c.value = value;
+    const Word bit = Word(1) << (column % WORD_BITS);
+    if (value || !c.settled)
+        m_live[t.firstWord + column / WORD_BITS] |= bit;
+    else
+        m_live[t.firstWord + column / WORD_BITS] &= ~bit;
+}
+
+void FlatMapper::TreeShift(__u32 shift, __u32 newSet, __u32 time, bool init,
+                           std::vector<js_event> &out)
+{
+    // Same as ShiftInput, for every shift the change affects: move each
+    // column whose route has changed from its old button to its new one
+    Shift &s = m_shifts[shift];
+    Tree &t = m_trees[s.tree];
+    const __u32 *from = &m_routes[t.firstRoute + t.state * t.numColumns];
+    t.state += (newSet - s.currentSet) * s.radix;
+    const __u32 *to = &m_routes[t.firstRoute + t.state * t.numColumns];
+    
+    const __u32 numWords = (t.numColumns + WORD_BITS - 1) / WORD_BITS;
+    for (__u32 w = 0; w < numWords; ++w)
+    {
+        for (Word bits = m_live[t.firstWord + w]; bits; bits &= bits - 1)
+        {
+            __u32 i = w * WORD_BITS + __builtin_ctzl(bits);
+            if (from[i] == to[i])
+                continue;
+            if (from[i] != NO_NODE)
+                NodeInput(from[i], time, 0, init, out);
+            if (to[i] != NO_NODE)
+                NodeInput(to[i], time, m_columns[t.firstColumn + i].value,
+                          init, out);
+        }
+    }
+    s.currentSet = newSet;
+    ++s.switches;
+}
@@ -0,0 +1,162 @@
+#if !defined(INCLUDED_FLATMAP_H_)
+#define INCLUDED_FLATMAP_H_
+
+/* (c) Peter Chapman 2010
+   Licensed under the GNU General Public Licence; either version 2 or (at your
+   option) any later version
+*/
+
+#include "joymodel.h"
+
+// A MappedJoystick lowered to flat arrays. Instead of travelling through
+// boost signals, an input event is looked up by input button/axis number and
+// propagated by walking short lists of actions, each of which either passes
+// the value on to another button or emits an event on the virtual joystick.
+//
+// This keeps its own state, so it is used in place of (not as well as)
+// feeding input into the signals of the MappedJoystick it was lowered from.
+//
+// Optionally, each tree of nested shifts can be compiled further into a
+// single state machine, whose state is the selected set of every shift in
+// the tree. Input to the tree is then looked up in one table, by state and
+// input, whatever the depth of nesting. This relies on the joystick sending
+// JS_EVENT_INIT for every button first, as the kernel does.
+class FlatMapper
+{
+    enum Op {
+        OP_EMIT_BUTTON,     // a: output button number
+        OP_SHIFT_INPUT,     // a: shift, b: input slot
+        OP_SHIFT_CONDITION, // a: rotation group, test: button state
+        OP_HAT,             // a: hat button node, positive
+        OP_EMIT_AXIS,       // a: output axis number
+        OP_ROUTE            // a: tree, b: column
+    };
+
+    struct Action
+    {
+        __u8      op;
+        __u8      positive;
+        __s16     test;
+        __u32     a, b;
+    };
+
+    // A button anywhere in the model: real, hat or output of a shift
+    struct Node
+    {
+        __s16     value;
+        __u8      initialised;
+        __u8      reserved;
+        __u32     firstAction, numActions;
+    };
+
+    struct AxisState
+    {
+        __s16     value;
+        __u32     firstAction, numActions;
+    };
+
+    struct Shift
+    {
+        __u32     currentSet, numSets, numInputs;
+        __u32     firstOutput;  // into m_outputs, [set * numInputs + slot]
+        __u32     firstWord;    // into m_pressed & m_unsettled
+        __u32     tree;         // NO_TREE if not compiled into one
+        __u32     radix;        // value of this shift's set in tree state
+        unsigned long switches; // times currentSet changed
+    };
+
+    // A compiled tree of shifts. Its state is the sum of each shift's
+    // currentSet * radix, and its columns are inputs that come from outside
+    // the tree. The button that a column's input ends up at is
+    // m_routes[firstRoute + state * numColumns + column].
+    struct Tree
+    {
+        __u32     state, numColumns;
+        __u32     firstColumn;  // into m_columns
+        __u32     firstRoute;   // into m_routes
+        __u32     firstWord;    // into m_live
+    };
+
+    struct Column
+    {
+        __u32     firstLeaf, numLeaves; // every button it can end up at
+        __s16     value;
+        __u8      settled;      // had JS_EVENT_INIT
+        __u8      reserved;
+    };
+
+    // Identical conditions on a shift are cycled between: this is the cycle
+    struct Group
+    {
+        __u32     shift;
+        __u32     firstSet, numSets; // into m_groupSets
+        __u32     head;
+    };
+
+    static const __u32 NO_NODE = ~__u32(0);
+    static const __u32 NO_TREE = ~__u32(0);
+    static const __u32 MAX_ROUTES = 1 << 18;    // per tree
+    
+    typedef unsigned long Word;
+    static const unsigned WORD_BITS = sizeof(Word) * 8;
+
+    std::vector<Node>      m_nodes;
+    std::vector<Action>    m_actions;
+    std::vector<__u32>     m_inputButtons; // input button -> node
+    std::vector<AxisState> m_inputAxes;
+    std::vector<Shift>     m_shifts;
+    std::vector<__u32>     m_outputs;
+    std::vector<Word>      m_pressed;      // by shift input slot, as ShiftSet
+    std::vector<Word>      m_unsettled;
+    std::vector<Tree>      m_trees;
+    std::vector<Column>    m_columns;
+    std::vector<__u32>     m_routes;
+    std::vector<__u32>     m_leaves;
+    std::vector<Word>      m_live;         // by column: pressed or unsettled
+    
+    typedef std::vector<std::vector<Action> > ActionLists;
+    void Flatten(const MapTables &t, ActionLists &nodeActions);
+    bool FlattenTree(const MapTables &t, const std::vector<__u32> &shifts,
+                     ActionLists &nodeActions,
+                     const std::vector<unsigned> &outputUses);
+    __u32 Route(__u32 state, __u32 shift, __u32 slot) const;
+    std::vector<Group>     m_groups;
+    std::vector<__u32>     m_groupSets;
+    std::vector<__u32>     m_buttons;      // output button -> node
+    std::vector<__u32>     m_axes;         // output axis -> input axis
+
+    void Fire(__u32 first, __u32 num, __u32 time, __s16 value, bool init,
+              std::vector<js_event> &out);
+    void NodeInput(__u32 node, __u32 time, __s16 value, bool init,
+                   std::vector<js_event> &out);
+    void ShiftInput(__u32 group, __u32 time, bool init,
+                    std::vector<js_event> &out);
+    void RouteInput(__u32 tree, __u32 column, __u32 time, __s16 value,
+                    bool init, std::vector<js_event> &out);
+    void TreeShift(__u32 shift, __u32 newSet, __u32 time, bool init,
+                   std::vector<js_event> &out);
+
+public:
+    // 'flatten' compiles trees of shifts into state machines where it can
+    FlatMapper(const MapTables &tables, unsigned inputButtons,
+               unsigned inputAxes, bool flatten = false);
+
+    // Map one event from the real joystick, appending any resulting events
+    // on the virtual joystick to 'out'
+    void Input(const js_event &e, std::vector<js_event> &out);
+
+    unsigned NumButtons() const { return m_buttons.size(); }
+    unsigned NumAxes()    const { return m_axes.size(); }
+    __s16 ButtonValue(unsigned i) const { return m_nodes[m_buttons[i]].value; }
+    __s16 AxisValue(unsigned i) const { return m_inputAxes[m_axes[i]].value; }
+    
+    // Same as MappedJoystick::ShiftSwitches
+    unsigned NumShifts() const { return m_shifts.size(); }
+    unsigned NumFlattened() const;
+    unsigned long ShiftSwitches(unsigned s) const
+    {
+        return m_shifts[s].switches;
+    }
+};
+
+#endif
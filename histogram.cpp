@@ -0,0 +1,68 @@
+/* (c) Peter Chapman 2010
+   Licensed under the GNU General Public Licence; either version 2 or (at your
+   option) any later version
+*/
+#include "histogram.h"
+
+#include <algorithm>
+#include <boost/format.hpp>
+
+Histogram::Histogram()
+    : m_total(0)
+{
+    std::fill(m_counts, m_counts + BUCKETS, 0);
+}
+
+__u64 Histogram::BucketMax(unsigned b)
+{
+    if (b < 2 * SUBS)
+        return b;
+    const unsigned e = b / SUBS + SUB_BITS - 1;
+    const __u64 lower = __u64(SUBS + b % SUBS) << (e - SUB_BITS);
+    return lower + (__u64(1) << (e - SUB_BITS)) - 1;
+}
+
+void Histogram::Merge(const Histogram &other)
+{
+    for (unsigned b = 0; b < BUCKETS; ++b)
+        m_counts[b] += other.m_counts[b];
+    m_total += other.m_total;
+}
+
+__u64 Histogram::Percentile(double p) const
+{
+    const __u64 total = m_total;
+    if (total == 0)
+        return 0;
+    
+    __u64 wanted = __u64(p * total + 0.5), seen = 0;
+    if (wanted == 0)
+        wanted = 1;
+    for (unsigned b = 0; b < BUCKETS; ++b)
+    {
+        seen += m_counts[b];
+        if (seen >= wanted)
+            return BucketMax(b);
+    }
+    return BucketMax(BUCKETS - 1);
+}
+
+static std::string Duration(__u64 ns)
+{
+    if (ns < 1000)
+        return str(boost::format("%uns") % unsigned(ns));
+    if (ns < 1000000)
+        return str(boost::format("%.3gus") % (ns / 1e3));
+    if (ns < 1000000000)
+        return str(boost::format("%.3gms") % (ns / 1e6));
+    return str(boost::format("%.3gs") % (ns / 1e9));
+}
+
+std::string Histogram::Summary() const
+{
+    return str(boost::format("n=%u p50=%s p99=%s p999=%s")
+               % m_total
+               % Duration(Percentile(0.5))
+               % Duration(Percentile(0.99))
+               % Duration(Percentile(0.999)));
+}
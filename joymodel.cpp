@@ -3,9 +3,15 @@
    option) any later version
 */
 #include <sys/ioctl.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "joymodel.h"
 
 #include <iostream>
+#include <cstdio>
+#include <cerrno>
 #include <libxml/parser.h>
 #include <boost/lexical_cast.hpp>
 #include <boost/scoped_array.hpp>
@@ -15,19 +21,189 @@
 
 #define SS_JS_CORR_UNMAPPED 0x10
 
+namespace
+{
+    // RAII lock for pthread
+    struct Lock
+    {
+        pthread_mutex_t &mutex;
+        Lock(pthread_mutex_t &mutex) : mutex(mutex)
+        {
+            pthread_mutex_lock(&mutex);
+        }
+        ~Lock() { pthread_mutex_unlock(&mutex); }
+    };
+    
+    bool SameCorrection(const js_corr &a, const js_corr &b)
+    {
+        return memcmp(&a, &b, sizeof(js_corr)) == 0;
+    }
+}
+
+namespace
+{
+    // Ids of destroyed buttons are reused, to keep ButtonSet bitsets short
+    // however many times a config is reloaded. Statically initialised, so it
+    // can be used whenever buttons are destroyed.
+    pthread_mutex_t s_idMutex = PTHREAD_MUTEX_INITIALIZER;
+    unsigned s_nextId;
+    
+    std::vector<unsigned> &FreeIds()
+    {
+        // Never destroyed: buttons may outlive static destruction
+        static std::vector<unsigned> *ids = new std::vector<unsigned>;
+        return *ids;
+    }
+}
+
+unsigned Button::AllocateId()
+{
+    Lock l(s_idMutex);
+    std::vector<unsigned> &ids = FreeIds();
+    if (ids.empty())
+        return s_nextId++;
+    const unsigned id = ids.back();
+    ids.pop_back();
+    return id;
+}
+
+void Button::FreeId(unsigned id)
+{
+    Lock l(s_idMutex);
+    FreeIds().push_back(id);
+}
+
+void ButtonSet::Sort() const
+{
+    if (m_sorted == m_order.size())
+        return;
+    
+    std::vector<ButtonPtr>::iterator mid = m_order.begin() + m_sorted;
+    std::sort(mid, m_order.end(), ButtonOrder());
+    if (m_sorted && ButtonOrder()(*mid, *(mid - 1)))
+        std::inplace_merge(m_order.begin(), mid, m_order.end(),
+                           ButtonOrder());
+    m_sorted = m_order.size();
+}
+
+void ButtonSet::Tidy()
+{
+    // Keeps the order of what's left, sorted or not
+    size_t out = 0, sorted = 0;
+    for (size_t i = 0; i < m_order.size(); ++i)
+    {
+        if (!Has(m_order[i]->Id()))
+            continue;
+        if (i < m_sorted)
+            ++sorted;
+        m_order[out++].swap(m_order[i]);
+    }
+    m_order.resize(out);
+    m_sorted = sorted;
+}
+
+ButtonSet::const_iterator ButtonSet::find(const ButtonPtr &b) const
+{
+    if (!count(b))
+        return end();
+    Sort();
+    return const_iterator(this, std::lower_bound(m_order.begin(),
+                                                 m_order.end(), b,
+                                                 ButtonOrder()));
+}
+
+size_t ButtonSet::erase(const ButtonPtr &b)
+{
+    if (!count(b))
+        return 0;
+    const unsigned id = b->Id();
+    m_bits[id / WORD_BITS] &= ~(Word(1) << (id % WORD_BITS));
+    --m_size;
+    if (m_order.size() > 2 * m_size + WORD_BITS)
+        Tidy();
+    return 1;
+}
+
+void ButtonSet::clear()
+{
+    m_order.clear();
+    m_sorted = 0;
+    m_bits.clear();
+    m_size = 0;
+}
+
+size_t ButtonSet::Remove(const ButtonSet &what, ButtonSet *removed)
+{
+    const size_t words = std::min(m_bits.size(), what.m_bits.size());
+    std::vector<Word> gone(words);
+    size_t n = 0;
+    for (size_t w = 0; w < words; ++w)
+    {
+        gone[w] = m_bits[w] & what.m_bits[w];
+        m_bits[w] &= ~gone[w];
+        n += __builtin_popcountl(gone[w]);
+    }
+    if (!n)
+        return 0;
+    
+    if (removed)
+    {
+        Sort();
+        ButtonSet r;
+        BOOST_FOREACH (const ButtonPtr &b, m_order)
+        {
+            const unsigned id = b->Id();
+            if (id / WORD_BITS < words &&
+                (gone[id / WORD_BITS] >> (id % WORD_BITS) & 1))
+                r.m_order.push_back(b);     // already in order
+        }
+        r.m_bits.swap(gone);
+        r.m_sorted = r.m_size = n;
+        removed->insert(r.begin(), r.end());
+    }
+    m_size -= n;
+    if (m_order.size() > 2 * m_size + WORD_BITS)
+        Tidy();
+    return n;
+}
+
+bool ButtonSet::operator==(const ButtonSet &other) const
+{
+    if (m_size != other.m_size)
+        return false;
+    const size_t words = std::max(m_bits.size(), other.m_bits.size());
+    for (size_t w = 0; w < words; ++w)
+    {
+        const Word a = w < m_bits.size() ? m_bits[w] : 0;
+        const Word b = w < other.m_bits.size() ? other.m_bits[w] : 0;
+        if (a != b)
+            return false;
+    }
+    return true;
+}
+
 ShiftSet::ShiftSet(ButtonSetPtr inputButtons)
  : m_inputButtons(inputButtons),
-   m_currentSet(0)
+   m_inputs(inputButtons->begin(), inputButtons->end()),
+   m_currentSet(0),
+   m_switches(0),
+   m_pressed((inputButtons->size() + WORD_BITS - 1) / WORD_BITS, 0),
+   m_unsettled(m_pressed.size(), 0)
 {
+    for (unsigned i = 0; i < m_inputs.size(); ++i)
+        m_unsettled[i / WORD_BITS] |= Word(1) << (i % WORD_BITS);
 }
 
 ShiftSetPtr ShiftSet::Create(ButtonSetPtr input)
 {
     using namespace boost;
     ShiftSetPtr p(new ShiftSet(input));
-    BOOST_FOREACH(ButtonPtr i, *input)
+    for (unsigned slot = 0; slot < p->m_inputs.size(); ++slot)
+    {
+        const ButtonPtr &i = p->m_inputs[slot];
         i->Connect(ChangeSig::slot_type(&ShiftSet::Input, p.get(),
-                                        _1, _2, _3, i.get()).track(p).track(i));
+                                        _1, _2, _3, slot).track(p).track(i));
+    }
     return p;
 }
 
@@ -40,10 +216,7 @@ ButtonMappingPtr ShiftSet::AddCondition(
     
     ButtonMappingPtr outputs(new ButtonMapping());
     
-    // Shift buttons don't appear in the output
-    assert(m_inputButtons->find(button) == m_inputButtons->end());
-    
-    const bool firstSet = m_shiftMap.empty();
+    const bool firstSet = m_conditionStates.empty();
     for (ButtonSet::iterator i = m_inputButtons->begin();
          i != m_inputButtons->end(); ++i)
     {
@@ -53,28 +226,50 @@ ButtonMappingPtr ShiftSet::AddCondition(
         ButtonPtr newButton =
             reuse==sharedButtons.end() ? make_shared<Button>(mapping, order)
                                        : reuse->second;
-        std::vector<ButtonPtr> &sets = m_shiftMap[i->get()];
-        assert(sets.size() == m_conditionStates.size());
-        
-        sets.push_back(newButton);
-        
         (*outputs)[*i] = newButton;
     }
     
+    AddCondition(button, state, *outputs);
+    return outputs;
+}
+
+void ShiftSet::AddCondition(ButtonPtr button, __s16 state,
+                            const ButtonMapping &outputs)
+{
+    using namespace boost;
+    
+    // Shift buttons don't appear in the output
+    assert(m_inputButtons->find(button) == m_inputButtons->end());
+    assert(m_outputs.size() == m_conditionStates.size() * m_inputs.size());
+    
+    BOOST_FOREACH (const ButtonPtr &i, m_inputs)
+    {
+        ButtonMapping::const_iterator o = outputs.find(i);
+        if (o == outputs.end() || !o->second)
+            throw std::runtime_error("shift condition has no output for "
+                                     "an input button");
+        m_outputs.push_back(o->second);
+    }
+    
     unsigned shiftIndex = m_conditionStates.size();
     Condition condition(button, state);
-    if (m_rotationMap[condition].empty())
+    std::map<Condition, unsigned>::iterator index =
+        m_rotationIndex.find(condition);
+    const unsigned r = index == m_rotationIndex.end() ? m_rotations.size()
+                                                     : index->second;
+    if (r == m_rotations.size())
     {
+        m_rotationIndex[condition] = r;
+        Rotation rotation = { condition, std::vector<unsigned>(), 0 };
+        m_rotations.push_back(rotation);
         button->Connect(ChangeSig::slot_type(
             &ShiftSet::ShiftInput, this, _1, _2, _3, state,
-            boost::ref(m_rotationMap[condition])).track(shared_from_this()));
+            r).track(shared_from_this()));
     }
-    m_rotationMap[condition].push_back(shiftIndex);
+    m_rotations[r].sets.push_back(shiftIndex);
     
     ConditionState cs = { condition };
     m_conditionStates.push_back(cs);
-    
-    return outputs;
 }
 
 void ShiftSet::SetSubShifts(const std::vector<ShiftSetPtr> &shifts)
@@ -82,15 +277,19 @@ void ShiftSet::SetSubShifts(const std::vector<ShiftSetPtr> &shifts)
     m_conditionStates.back().subShifts = shifts;
 }
 
+void ShiftSet::SetSubShifts(unsigned condition,
+                            const std::vector<ShiftSetPtr> &shifts)
+{
+    m_conditionStates.at(condition).subShifts = shifts;
+}
+
 void ShiftSet::AllOutputs(ButtonSet &outputs) const
 {
     // remove our inputs
-    BOOST_FOREACH (ButtonPtr b, *m_inputButtons)
-        outputs.erase(b);
+    outputs.Remove(*m_inputButtons);
     
     // Add our outputs
-    BOOST_FOREACH (const ShiftMap::value_type &v, m_shiftMap)
-        outputs.insert(v.second.begin(), v.second.end());
+    outputs.insert(m_outputs.begin(), m_outputs.end());
     
     // Add the output of subshifts
     BOOST_FOREACH (const ConditionState &c, m_conditionStates)
@@ -103,51 +302,63 @@ void ShiftSet::AllOutputs(ButtonSet &outputs) const
     }
 }
 
-void ShiftSet::Input(__u32 time, __s16 value, bool init, Button *inButton)
+void ShiftSet::Input(__u32 time, __s16 value, bool init, unsigned slot)
 {
-    ShiftMap::iterator i = m_shiftMap.find(inButton);
-    if (i == m_shiftMap.end())
+    const unsigned numSets = m_conditionStates.size();
+    if (m_currentSet >= numSets)
         return;
-    std::vector<ButtonPtr> &outputs = i->second;
     
-    if (m_currentSet >= outputs.size())
-        return;
-    
-    outputs[m_currentSet]->Input(time, value, init);
+    const unsigned stride = m_inputs.size();
+    m_outputs[m_currentSet * stride + slot]->Input(time, value, init);
     
     if (init)
-        for (unsigned j = 0; j < outputs.size(); ++j)
+        for (unsigned j = 0; j < numSets; ++j)
             if (j != m_currentSet)
-                outputs[j]->Input(time, 0, init);
+                m_outputs[j * stride + slot]->Input(time, 0, init);
+    
+    const Word bit = Word(1) << (slot % WORD_BITS);
+    if (value)
+        m_pressed[slot / WORD_BITS] |= bit;
+    else
+        m_pressed[slot / WORD_BITS] &= ~bit;
+    if (init)
+        m_unsettled[slot / WORD_BITS] &= ~bit;
 }
 
 void ShiftSet::ShiftInput(__u32 time, __s16 value, bool init, __u16 testValue,
-                          std::list<unsigned> &rotations)
+                          unsigned rotation)
 {
     if (value != testValue)
         return;
 
-    // move front index to the back
-    rotations.splice(rotations.end(), rotations, rotations.begin());
+    // move on to the next set in the rotation
+    Rotation &r = m_rotations[rotation];
+    r.head = (r.head + 1) % r.sets.size();
     
-    unsigned newSet = rotations.front();
+    unsigned newSet = r.sets[r.head];
     if (m_currentSet == newSet)
         return; // already selected - nothing to do
     
     // Copy values of previously selected buttons to the newly selected
-    // buttons, and set the former to 0
-    for (ShiftMap::iterator i = m_shiftMap.begin(); i != m_shiftMap.end(); ++i)
+    // buttons, and set the former to 0. Released inputs have nothing to copy.
+    const unsigned stride = m_inputs.size();
+    const ButtonPtr *from = &m_outputs[m_currentSet * stride];
+    const ButtonPtr *to = &m_outputs[newSet * stride];
+    for (unsigned w = 0; w < m_pressed.size(); ++w)
     {
-        using namespace std;
-        std::vector<ButtonPtr> &shifts = i->second;
-        if (shifts[newSet] == shifts[m_currentSet])
-            continue;
-        
-        __s16 oldval = shifts[m_currentSet]->GetValue();
-        shifts[m_currentSet]->Input(time, 0, init);
-        shifts[newSet]->Input(time, oldval, init);
+        for (Word bits = m_pressed[w] | m_unsettled[w]; bits; bits &= bits - 1)
+        {
+            unsigned i = w * WORD_BITS + __builtin_ctzl(bits);
+            if (from[i] == to[i])
+                continue;
+            
+            __s16 oldval = from[i]->GetValue();
+            from[i]->Input(time, 0, init);
+            to[i]->Input(time, oldval, init);
+        }
     }
     m_currentSet = newSet;
+    ++m_switches;
 }
 
 bool GetProp(xmlNode *node, const char *name, std::string &val)
@@ -172,7 +383,11 @@ ButtonSetPtr ParseAxisButtons(xmlNode *node, InputContext &context)
     if (!GetProp(node, "axis", axisStr))
         return retVal;
     unsigned axis;
-    try {
+    std::map<std::string, unsigned>::const_iterator alias =
+            context.axisNames.find(axisStr);
+    if (alias != context.axisNames.end())
+        axis = alias->second;
+    else try {
         axis = lexical_cast<unsigned>(axisStr);
     } catch (boost::bad_lexical_cast &) {
         axis = context.axes.size(); // invalid
@@ -182,8 +397,8 @@ ButtonSetPtr ParseAxisButtons(xmlNode *node, InputContext &context)
             str(format("no such axis '%s'") % axisStr));
 
     AxisPtr &axisPtr = context.axes[axis];
-    ButtonPtr neg = HatButton::Create(axisPtr, false);
-    ButtonPtr pos = HatButton::Create(axisPtr, true);
+    ButtonPtr neg = HatButton::Create(axisPtr, axis, false);
+    ButtonPtr pos = HatButton::Create(axisPtr, axis, true);
     
     retVal = make_shared<ButtonSet>();
     retVal->insert(neg);
@@ -212,20 +427,21 @@ ButtonSetPtr Lookup(InputContext &context, const std::string &name)
     ButtonSetMap::const_iterator i = context.buttons.find(name);
     if (i == context.buttons.end() || i->second.empty())
         return ButtonSetPtr();
-    ButtonSetPtr ret(new ButtonSet(i->second));
+    ButtonSetPtr ret(new ButtonSet());
     
-    BOOST_FOREACH (ButtonMappingPtr &bm, context.layers)
+    // Follow each button through the layers, outermost first, to whatever
+    // replaces it in the innermost
+    BOOST_FOREACH (ButtonPtr b, i->second)
     {
-        BOOST_FOREACH (ButtonMapping::value_type &i, *bm)
+        for (unsigned l = 0; b && l < context.layers.size(); ++l)
         {
-            ButtonSet::iterator j = ret->find(i.first);
-            if (j != ret->end())
-            {
-                ret->erase(j);
-                if (i.second)
-                    ret->insert(i.second);
-            }
+            const ButtonMapping &bm = *context.layers[l];
+            ButtonMapping::const_iterator j = bm.find(b);
+            if (j != bm.end())
+                b = j->second;
         }
+        if (b)
+            ret->insert(b);
     }
     
     if (ret->empty())
@@ -274,11 +490,15 @@ ButtonSetPtr ParseBset(xmlNode *bsetNode, InputContext &context,
     if (GetProp(bsetNode, "begin", beginStr) &&
         GetProp(bsetNode, "end", endStr))
     {
+        // With device="D", the range is of the Dth merged joystick's buttons
+        std::string prefix;
+        if (GetProp(bsetNode, "device", prefix))
+            prefix += ':';
         unsigned begin = lexical_cast<unsigned>(beginStr);
         unsigned end = lexical_cast<unsigned>(endStr);
         for (; begin <= end; ++begin)
         {
-            std::string idxStr = lexical_cast<std::string>(begin);
+            std::string idxStr = prefix + lexical_cast<std::string>(begin);
             if (ButtonSetPtr bs = Lookup(context, idxStr))
                 bset->insert(bs->begin(), bs->end());
         }
@@ -346,6 +566,7 @@ bool ParseReuse(xmlNode *node, InputContext &context,
         
         shared[*i] = *o;
     }
+    return true;
 }
 
 const char *bLineCoefNames[4] = { "centre_min", "centre_max",
@@ -496,14 +717,12 @@ void Erase(InputContext &context, const ButtonSet &bs)
     
     BOOST_REVERSE_FOREACH(ButtonMappingPtr &bm, context.layers)
     {
+        if (toDel.empty())
+            break;
         BOOST_FOREACH(ButtonMapping::value_type &v, *bm)
         {
-            ButtonSet::iterator i = toDel.find(v.second);
-            if (i != toDel.end())
-            {
+            if (toDel.erase(v.second))
                 v.second.reset();
-                toDel.erase(i);
-            }
         }
     }
     
@@ -512,11 +731,9 @@ void Erase(InputContext &context, const ButtonSet &bs)
     
     ButtonSet deleted;
     for (ButtonSetMap::iterator i = context.buttons.begin();
-         i != context.buttons.end();)
+         !toDel.empty() && i != context.buttons.end();)
     {
-        BOOST_FOREACH (const ButtonPtr &b, toDel)
-            if (i->second.erase(b))
-                deleted.insert(b);
+        i->second.Remove(toDel, &deleted);
         
         if (i->second.empty())
             context.buttons.erase(i++);
@@ -561,11 +778,8 @@ ShiftSetPtr ParseShift(xmlNode *shiftNode, InputContext &context)
         if (context.layers.empty())
         {
             std::cerr << "No bset given: using "<<context.buttons[""].size()<<" top-level buttons\n";
-            inputSet.reset(new ButtonSet());
-            ButtonSet &all = context.buttons[""];
-            std::set_difference(all.begin(), all.end(),
-                                context.conditionals.begin(), context.conditionals.end(),
-                                inserter(*inputSet, inputSet->end()), ButtonOrder());
+            inputSet.reset(new ButtonSet(context.buttons[""]));
+            inputSet->Remove(context.conditionals);
         }
         else
         {
@@ -582,8 +796,7 @@ ShiftSetPtr ParseShift(xmlNode *shiftNode, InputContext &context)
                                 conditionButtons.end());
     // condition buttons are not inputs to the ShiftSet and do not appear in
     // the output
-    BOOST_FOREACH(const ButtonPtr &b, context.conditionals)
-        inputSet->erase(b);
+    inputSet->Remove(context.conditionals);
     std::cerr << "After removing conditions: "<<inputSet->size()<<" buttons\n";
         
     shift = ShiftSet::Create(inputSet);
@@ -605,10 +818,73 @@ ShiftSetPtr ParseShift(xmlNode *shiftNode, InputContext &context)
     return shift;
 }
 
+boost::shared_ptr<xmlDoc> ReadXml(const char *mapfile)
+{
+    using namespace boost;
+    
+    xmlLineNumbersDefault(1);
+    if (xmlDoc *doc = xmlReadFile(mapfile, NULL, XML_PARSE_NOERROR))
+        return shared_ptr<xmlDoc>(doc, bind(&xmlFreeDoc, _1));
+    
+    xmlErrorPtr err = xmlGetLastError();
+    std::string msg;
+    if (err)
+        msg = str(format("Error reading %s, line %d: %s") % mapfile
+                                                          % err->line
+                                                          % err->message);
+    else
+        msg = str(format("Error reading %s") % mapfile);
+    
+    throw std::runtime_error(msg);
+}
+
+// Writes calibrations out to a config file from a thread of its own, so that
+// whoever sets them doesn't wait for the disk. Calibration tools set them
+// over and over: only the last of a burst is written. The whole file is
+// written under a temporary name and renamed over the old one, so nobody
+// ever sees it half written.
+class CalibrationWriter
+{
+    const std::string         m_mapfile;
+    const std::string         m_configOut;
+    boost::shared_ptr<xmlDoc> m_xmlDoc;      // writer thread only
+    
+    // Guards everything below
+    pthread_mutex_t           m_mutex;
+    pthread_cond_t            m_cond;
+    std::vector<js_corr>      m_pending;
+    unsigned long             m_saves;       // number of Save() calls
+    unsigned long             m_written;     // m_saves as of last write
+    bool                      m_exit;
+    bool                      m_started;
+    pthread_t                 m_thread;
+    
+    // A burst ends when nothing has been saved for SETTLE_MS, but is
+    // written anyway after MAX_DELAY_MS
+    static const long SETTLE_MS = 200;
+    static const long MAX_DELAY_MS = 2000;
+    
+    static void *threadproc(void *data);
+    void Run();
+    void Write(const std::vector<js_corr> &cal);
+    
+public:
+    // 'doc' is mapfile's XML, if it's already been read
+    CalibrationWriter(const char *mapfile, const char *configOut,
+                      boost::shared_ptr<xmlDoc> doc =
+                          boost::shared_ptr<xmlDoc>());
+    
+    // Writes out anything still waiting
+    ~CalibrationWriter();
+    
+    // Have 'num' corrections written out soon
+    void Save(const js_corr *cal, unsigned num);
+};
+
 MappedJoystick::MappedJoystick(JoystickPtr in, const char *mapfile,
                                const char *configOut)
     : m_in(in),
-      m_configOut(configOut)
+      m_coalesceAxes(false)
 {
     using namespace boost;
     m_name = std::string("StickShift: ") + in->GetName();
@@ -616,7 +892,12 @@ MappedJoystick::MappedJoystick(JoystickPtr in, const char *mapfile,
     InputContext input;
     
     for (unsigned i = 0; i < in->NumAxes(); ++i)
+    {
         input.axes.push_back(in->GetAxis(i));
+        std::string alias = in->AxisAlias(i);
+        if (!alias.empty())
+            input.axisNames[alias] = i;
+    }
 
     for (unsigned i = 0; i < in->NumButtons(); ++i)
     {
@@ -625,31 +906,19 @@ MappedJoystick::MappedJoystick(JoystickPtr in, const char *mapfile,
         bset.insert(inButton);
         input.buttonOrder = std::max(input.buttonOrder, inButton->GetOrder());
         input.buttons[lexical_cast<std::string>(i)] = bset;
+        std::string alias = in->ButtonAlias(i);
+        if (!alias.empty())
+            input.buttons[alias] = bset;
         input.buttons[""].insert(inButton);
     }
     
-    xmlDoc *doc = 0;
-
-    xmlLineNumbersDefault(1);
-    if (xmlDoc *doc = xmlReadFile(mapfile, NULL, XML_PARSE_NOERROR))
-    {
-        m_xmlDoc.reset(doc, bind(&xmlFreeDoc, _1));
-    }
-    else
-    {
-        xmlErrorPtr err = xmlGetLastError();
-        std::string msg;
-        if (err)
-            msg = str(format("Error reading %s, line %d: %s") % mapfile
-                                                              % err->line
-                                                              % err->message);
-        else
-            msg = str(format("Error reading %s") % mapfile);
-        
-        throw std::runtime_error(msg);
-    }
+    boost::shared_ptr<xmlDoc> doc = ReadXml(mapfile);
+    
+    xmlNode *root = xmlDocGetRootElement(doc.get());
+    std::string coalesce;
+    m_coalesceAxes = GetProp(root, "coalesce_axes", coalesce) &&
+                     coalesce == "true";
     
-    xmlNode *root = xmlDocGetRootElement(m_xmlDoc.get());
     for (xmlNode *i = root->children; i; i = i->next)
     {
         if (i->type != XML_ELEMENT_NODE)
@@ -659,29 +928,261 @@ MappedJoystick::MappedJoystick(JoystickPtr in, const char *mapfile,
         else if (ShiftSetPtr p = ParseShift(i, input)) 
             m_shifts.push_back(p);
         else if (CalibrationPtr cal = ParseCalibrate(i))
+        {
             m_in->Calibrate(cal);
+            BOOST_FOREACH (Calibration::value_type &c, *cal)
+                m_calibration[c.first] = c.second;
+        }
     }
     
     ButtonSet all = input.buttons[""];
     BOOST_FOREACH (ShiftSetPtr ss, m_shifts)
         ss->AllOutputs(all);
     
-    std::set_difference(all.begin(), all.end(),
-                        input.conditionals.begin(), input.conditionals.end(),
-                        back_inserter(m_buttons), ButtonOrder());
+    all.Remove(input.conditionals);
+    m_buttons.assign(all.begin(), all.end());
     
     for (unsigned inIdx = 0; inIdx < input.axes.size(); ++inIdx)
         if (input.axes[inIdx])
             m_axes.push_back(inIdx);
+    
+    pthread_mutex_init(&m_corrMutex, NULL);
+    if (configOut)
+        m_calibrationWriter.reset(new CalibrationWriter(mapfile, configOut,
+                                                        doc));
 }
 
-void MappedJoystick::GetCorrection(js_corr *out) const
+// Range-checked lookup of an index stored in MapTables
+static __u32 TableEntry(const std::vector<__u32> &v, size_t i, size_t max)
+{
+    if (i >= v.size() || v[i] >= max)
+        throw std::runtime_error("inconsistent mapping tables");
+    return v[i];
+}
+
+MappedJoystick::MappedJoystick(JoystickPtr in, const MapTables &t,
+                               const char *mapfile, const char *configOut)
+    : m_in(in),
+      m_coalesceAxes(t.flags & MapTables::COALESCE_AXES)
 {
+    using namespace boost;
+    typedef MapTables::Node Node;
+    typedef MapTables::Shift Shift;
+    typedef MapTables::Condition Condition;
+    m_name = std::string("StickShift: ") + in->GetName();
+    
+    const std::runtime_error bad("inconsistent mapping tables");
+    
+    std::vector<ButtonPtr> nodes;
+    BOOST_FOREACH (const Node &n, t.nodes)
+    {
+        switch (n.kind)
+        {
+        case MapTables::NODE_INPUT:
+            if (n.index >= in->NumButtons())
+                throw bad;
+            nodes.push_back(in->GetButton(n.index));
+            break;
+        case MapTables::NODE_HAT:
+            if (n.index >= in->NumAxes())
+                throw bad;
+            nodes.push_back(HatButton::Create(in->GetAxis(n.index), n.index,
+                                              n.positive));
+            break;
+        case MapTables::NODE_SHIFTED:
+            nodes.push_back(make_shared<Button>(n.mapping, n.order));
+            break;
+        default:
+            throw bad;
+        }
+    }
     
-    boost::scoped_array<js_corr> orig(new js_corr[m_in->NumAxes()]());
-    m_in->GetCorrection(orig.get());
+    std::vector<ShiftSetPtr> shifts;
+    BOOST_FOREACH (const Shift &s, t.shifts)
+    {
+        ButtonSetPtr inputs(new ButtonSet());
+        for (unsigned i = 0; i < s.numInputs; ++i)
+            inputs->insert(nodes[TableEntry(t.shiftInputs, s.firstInput + i,
+                                            nodes.size())]);
+        ShiftSetPtr ss = ShiftSet::Create(inputs);
+        shifts.push_back(ss);
+        
+        if (s.firstCondition + s.numConditions > t.conditions.size())
+            throw bad;
+        for (unsigned c = 0; c < s.numConditions; ++c)
+        {
+            const Condition &cond = t.conditions[s.firstCondition + c];
+            ButtonMapping outputs;
+            for (unsigned i = 0; i < s.numInputs; ++i)
+            {
+                ButtonPtr input = nodes[t.shiftInputs[s.firstInput + i]];
+                outputs[input] = nodes[TableEntry(t.conditionOutputs,
+                                                  cond.firstOutput + i,
+                                                  nodes.size())];
+            }
+            if (cond.button >= nodes.size())
+                throw bad;
+            ss->AddCondition(nodes[cond.button], cond.state, outputs);
+        }
+    }
+    
+    // Subshifts always follow their parent, so they can only be attached now
+    for (unsigned s = 0; s < t.shifts.size(); ++s)
+    {
+        const Shift &shift = t.shifts[s];
+        for (unsigned c = 0; c < shift.numConditions; ++c)
+        {
+            const Condition &cond = t.conditions[shift.firstCondition + c];
+            std::vector<ShiftSetPtr> subs;
+            for (unsigned i = 0; i < cond.numSubs; ++i)
+                subs.push_back(shifts[TableEntry(t.subShifts,
+                                                 cond.firstSub + i,
+                                                 shifts.size())]);
+            shifts[s]->SetSubShifts(c, subs);
+        }
+    }
+    
+    for (unsigned i = 0; i < t.rootShifts.size(); ++i)
+        m_shifts.push_back(shifts[TableEntry(t.rootShifts, i,
+                                             shifts.size())]);
+    for (unsigned i = 0; i < t.buttons.size(); ++i)
+        m_buttons.push_back(nodes[TableEntry(t.buttons, i, nodes.size())]);
+    for (unsigned i = 0; i < t.axes.size(); ++i)
+        m_axes.push_back(TableEntry(t.axes, i, in->NumAxes()));
+    
+    if (!t.calibration.empty())
+    {
+        CalibrationPtr cal(new Calibration());
+        BOOST_FOREACH (const MapTables::Correction &c, t.calibration)
+            (*cal)[c.axis] = c.corr;
+        m_in->Calibrate(cal);
+        m_calibration = *cal;
+    }
+    
+    pthread_mutex_init(&m_corrMutex, NULL);
+    if (configOut)
+        m_calibrationWriter.reset(new CalibrationWriter(mapfile, configOut));
+}
+
+MappedJoystick::~MappedJoystick()
+{
+    pthread_mutex_destroy(&m_corrMutex);
+}
+
+__u32 MappedJoystick::LowerButton(const ButtonPtr &b, MapTables &t,
+                                  Lowering &l) const
+{
+    NodeIds::iterator i = l.nodes.find(b.get());
+    if (i != l.nodes.end())
+        return i->second;
+    
+    MapTables::Node n = MapTables::Node();
+    n.kind = MapTables::NODE_SHIFTED;
+    n.mapping = b->GetMapping();
+    n.order = b->GetOrder();
+    NodeIds::const_iterator input = l.inputs.find(b.get());
+    if (input != l.inputs.end())
+    {
+        n.kind = MapTables::NODE_INPUT;
+        n.index = input->second;
+    }
+    if (const HatButton *hat = dynamic_cast<const HatButton*>(b.get()))
+    {
+        n.kind = MapTables::NODE_HAT;
+        n.index = hat->AxisIndex();
+        n.positive = hat->Positive();
+    }
+    
+    __u32 id = t.nodes.size();
+    t.nodes.push_back(n);
+    l.nodes[b.get()] = id;
+    return id;
+}
+
+__u32 MappedJoystick::LowerShift(const ShiftSet &ss, MapTables &t,
+                                 Lowering &l) const
+{
+    __u32 id = t.shifts.size();
+    MapTables::Shift s;
+    s.firstInput = t.shiftInputs.size();
+    s.numInputs = ss.m_inputButtons->size();
+    s.firstCondition = t.conditions.size();
+    s.numConditions = ss.m_conditionStates.size();
+    t.shifts.push_back(s);
+    t.conditions.resize(t.conditions.size() + s.numConditions);
+    
+    BOOST_FOREACH (const ButtonPtr &b, *ss.m_inputButtons)
+        t.shiftInputs.push_back(LowerButton(b, t, l));
+    
+    for (unsigned c = 0; c < s.numConditions; ++c)
+    {
+        const ShiftSet::ConditionState &cs = ss.m_conditionStates[c];
+        MapTables::Condition cond = MapTables::Condition();
+        cond.button = LowerButton(cs.condition.first, t, l);
+        cond.state = cs.condition.second;
+        cond.firstOutput = t.conditionOutputs.size();
+        for (unsigned i = 0; i < s.numInputs; ++i)
+        {
+            const ButtonPtr &out = ss.m_outputs[c * s.numInputs + i];
+            t.conditionOutputs.push_back(LowerButton(out, t, l));
+        }
+        
+        std::vector<__u32> subs;
+        BOOST_FOREACH (const ShiftSetPtr &sub, cs.subShifts)
+            subs.push_back(LowerShift(*sub, t, l));
+        cond.firstSub = t.subShifts.size();
+        cond.numSubs = subs.size();
+        t.subShifts.insert(t.subShifts.end(), subs.begin(), subs.end());
+        
+        t.conditions[s.firstCondition + c] = cond;
+    }
+    return id;
+}
+
+void MappedJoystick::Lower(MapTables &t) const
+{
+    t = MapTables();
+    Lowering l;
+    for (unsigned j = m_in->NumButtons(); j-- > 0;)
+        l.inputs[m_in->GetButton(j).get()] = j;   // first one wins
+    
+    BOOST_FOREACH (const ShiftSetPtr &ss, m_shifts)
+        t.rootShifts.push_back(LowerShift(*ss, t, l));
+    BOOST_FOREACH (const ButtonPtr &b, m_buttons)
+        t.buttons.push_back(LowerButton(b, t, l));
+    t.axes.assign(m_axes.begin(), m_axes.end());
+    t.flags = m_coalesceAxes ? MapTables::COALESCE_AXES : 0;
+    BOOST_FOREACH (const Calibration::value_type &c, m_calibration)
+    {
+        MapTables::Correction corr = { c.first, c.second };
+        t.calibration.push_back(corr);
+    }
+}
+
+void MappedJoystick::ShiftSwitches(const ShiftSet &ss,
+                                   std::vector<unsigned long> &switches)
+{
+    // Same order as LowerShift
+    switches.push_back(ss.Switches());
+    BOOST_FOREACH (const ShiftSet::ConditionState &cs, ss.m_conditionStates)
+        BOOST_FOREACH (const ShiftSetPtr &sub, cs.subShifts)
+            ShiftSwitches(*sub, switches);
+}
+
+void MappedJoystick::ShiftSwitches(std::vector<unsigned long> &switches) const
+{
+    switches.clear();
+    BOOST_FOREACH (const ShiftSetPtr &ss, m_shifts)
+        ShiftSwitches(*ss, switches);
+}
+
+void MappedJoystick::GetCorrection(js_corr *out) const
+{
+    std::vector<js_corr> corr(m_in->NumAxes());
+    if (!corr.empty())
+        m_in->GetCorrection(&corr[0]);
     for (unsigned i = 0; i < m_axes.size(); ++i)
-        out[i] = orig[m_axes[i]];
+        out[i] = corr[m_axes[i]];
 }
 
 AxisPtr MappedJoystick::GetAxis(unsigned i) const
@@ -764,36 +1265,188 @@ void AddCalibrationElement(xmlNode *root, const js_corr *cal, unsigned num)
     xmlAddChild(root, xmlNewText(BAD_CAST "\n"));
 }
 
-void MappedJoystick::SetCorrection(const js_corr *in)
+CalibrationWriter::CalibrationWriter(const char *mapfile,
+                                     const char *configOut,
+                                     boost::shared_ptr<xmlDoc> doc)
+    : m_mapfile(mapfile),
+      m_configOut(configOut),
+      m_xmlDoc(doc),
+      m_saves(0),
+      m_written(0),
+      m_exit(false),
+      m_started(false)
+{
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_cond, NULL);
+}
+
+CalibrationWriter::~CalibrationWriter()
+{
+    pthread_mutex_lock(&m_mutex);
+    m_exit = true;
+    pthread_cond_signal(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+    if (m_started)
+        pthread_join(m_thread, 0);
+    
+    pthread_cond_destroy(&m_cond);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+void CalibrationWriter::Save(const js_corr *cal, unsigned num)
+{
+    pthread_mutex_lock(&m_mutex);
+    m_pending.assign(cal, cal + num);
+    ++m_saves;
+    // The thread is only started once there's something for it to do
+    if (!m_started)
+        m_started = pthread_create(&m_thread, NULL, &threadproc, this) == 0;
+    const bool started = m_started;
+    pthread_cond_signal(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+    
+    if (!started)
+    {
+        std::cerr << "Can't create thread: writing calibration now\n";
+        Write(std::vector<js_corr>(cal, cal + num));
+    }
+}
+
+void *CalibrationWriter::threadproc(void *data)
+{
+    ((CalibrationWriter *)data)->Run();
+    return 0;
+}
+
+// 'ms' milliseconds after 'from'
+static timespec After(const timeval &from, long ms)
+{
+    timespec t;
+    t.tv_sec = from.tv_sec + ms / 1000;
+    t.tv_nsec = (from.tv_usec + ms % 1000 * 1000) * 1000;
+    if (t.tv_nsec >= 1000000000)
+    {
+        ++t.tv_sec;
+        t.tv_nsec -= 1000000000;
+    }
+    return t;
+}
+
+static bool Before(const timespec &a, const timespec &b)
+{
+    return a.tv_sec != b.tv_sec ? a.tv_sec < b.tv_sec : a.tv_nsec < b.tv_nsec;
+}
+
+void CalibrationWriter::Run()
+{
+    pthread_mutex_lock(&m_mutex);
+    for (;;)
+    {
+        while (m_saves == m_written && !m_exit)
+            pthread_cond_wait(&m_cond, &m_mutex);
+        if (m_saves == m_written)
+            break;
+        
+        // Wait for the burst to finish
+        timeval now;
+        gettimeofday(&now, 0);
+        const timespec latest = After(now, MAX_DELAY_MS);
+        for (;;)
+        {
+            const unsigned long saves = m_saves;
+            gettimeofday(&now, 0);
+            timespec until = After(now, SETTLE_MS);
+            const bool last = !Before(until, latest);
+            if (last)
+                until = latest;
+            
+            int err = 0;
+            while (m_saves == saves && !m_exit && err != ETIMEDOUT)
+                err = pthread_cond_timedwait(&m_cond, &m_mutex, &until);
+            if (m_saves == saves || m_exit || last)
+                break;
+        }
+        
+        std::vector<js_corr> cal(m_pending);
+        m_written = m_saves;
+        pthread_mutex_unlock(&m_mutex);
+        Write(cal);
+        pthread_mutex_lock(&m_mutex);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void CalibrationWriter::Write(const std::vector<js_corr> &cal)
 {
-    boost::scoped_array<js_corr> orig(new js_corr[m_in->NumAxes()]);
+    try {
+        if (!m_xmlDoc)
+            m_xmlDoc = ReadXml(m_mapfile.c_str());
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << ": calibration not saved\n";
+        return;
+    }
     
-    // Get corrections before we set them so that we can leave any unused axes
-    // (ie hat axes that are mapped to buttons) untouched
-    m_in->GetCorrection(orig.get());
-    for (unsigned i = 0; i < m_axes.size(); ++i)
-        orig[m_axes[i]] = in[i];
-    m_in->SetCorrection(orig.get());
+    xmlNode *root = xmlDocGetRootElement(m_xmlDoc.get());
+    RemoveAutogeneratedCalibrations(root);
+    AddCalibrationElement(root, cal.empty() ? 0 : &cal[0], cal.size());
+    
+    xmlChar *text = 0;
+    int size = 0;
+    xmlDocDumpMemory(m_xmlDoc.get(), &text, &size);
+    
+    const std::string temp = m_configOut + ".new";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0666);
+    bool ok = fd >= 0 && text;
+    for (int done = 0; ok && done < size;)
+    {
+        ssize_t n = write(fd, text + done, size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        ok = n > 0;
+        done += n;
+    }
+    ok = ok && fsync(fd) == 0;
+    if (fd >= 0)
+        ok = close(fd) == 0 && ok;
+    ok = ok && rename(temp.c_str(), m_configOut.c_str()) == 0;
+    xmlFree(text);
     
-    if (m_configOut)
+    if (!ok)
+    {
+        std::cerr << "Couldn't write " << m_configOut << '\n';
+        unlink(temp.c_str());
+    }
+}
+
+void MappedJoystick::SetCorrection(const js_corr *in)
+{
+    Lock l(m_corrMutex);
+    
+    // Leave any unused axes (ie hat axes that are mapped to buttons) as they
+    // are, and don't bother anyone if nothing's changed. Other mappings of
+    // the same joystick may be changing theirs, so the table isn't written
+    // back whole.
+    m_corrToSave.resize(m_in->NumAxes());
+    if (!m_in->UpdateCorrection(m_axes, in,
+                                m_corrToSave.empty() ? 0 : &m_corrToSave[0]))
+        return;
+    
+    if (m_calibrationWriter)
     {
-        const unsigned realAxes = m_in->NumAxes();
-        xmlNode *root = xmlDocGetRootElement(m_xmlDoc.get());
-        
         // Mark unmapped axes so that we can avoid writing out their
         // (unchanged) correction values to the output file.
-        for (unsigned i = 0; i < realAxes; ++i)
+        for (unsigned i = 0; i < m_corrToSave.size(); ++i)
             if (std::find(m_axes.begin(), m_axes.end(), i) == m_axes.end())
-                orig[i].type = SS_JS_CORR_UNMAPPED;
+                m_corrToSave[i].type = SS_JS_CORR_UNMAPPED;
         
-        RemoveAutogeneratedCalibrations(root);
-        AddCalibrationElement(root, orig.get(), realAxes);
-        xmlSaveFile(m_configOut, m_xmlDoc.get());
+        m_calibrationWriter->Save(&m_corrToSave[0], m_corrToSave.size());
     }
 }
 
-InputJoystick::InputJoystick(int fd)
-    : m_fd(fd)
+InputJoystick::InputJoystick(int fd, unsigned firstOrder,
+                             CorrectionTablePtr corr)
+    : m_corr(corr)
 {
     using namespace boost;
     char namebuf[256];
@@ -811,30 +1464,188 @@ InputJoystick::InputJoystick(int fd)
     ioctl(fd, JSIOCGAXES,    &axes);
     
     for (unsigned i = 0; i < buttons; ++i)
-        m_buttons.push_back(make_shared<Button>(buttonMap[i], i));
+        m_buttons.push_back(make_shared<Button>(buttonMap[i],
+                                                firstOrder + i));
     for (unsigned i = 0; i < axes; ++i)
         m_axes.push_back(make_shared<Axis>(axisMap[i]));
+    
+    if (!m_corr)
+        m_corr.reset(new CorrectionTable(fd));
 }
 
 void InputJoystick::GetCorrection(js_corr *corr) const
 {
-    ioctl(m_fd, JSIOCGCORR, corr);
+    m_corr->Get(corr);
 }
 
 void InputJoystick::SetCorrection(const js_corr *corr)
 {
-    ioctl(m_fd, JSIOCSCORR, corr);
+    std::vector<unsigned> axes;
+    for (unsigned i = 0; i < m_corr->Size(); ++i)
+        axes.push_back(i);
+    m_corr->Update(axes, corr, 0);
+}
+
+bool InputJoystick::UpdateCorrection(const std::vector<unsigned> &axes,
+                                     const js_corr *corr, js_corr *all)
+{
+    return m_corr->Update(axes, corr, all);
+}
+
+CorrectionTable::CorrectionTable(int fd)
+    : m_fd(fcntl(fd, F_DUPFD_CLOEXEC, 0))
+{
+    __u8 axes = 0;
+    ioctl(fd, JSIOCGAXES, &axes);
+    m_corr.resize(axes);
+    if (axes)
+        ioctl(fd, JSIOCGCORR, &m_corr[0]);
+    pthread_mutex_init(&m_mutex, NULL);
+}
+
+CorrectionTable::~CorrectionTable()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+void CorrectionTable::Get(js_corr *corr) const
+{
+    Lock l(m_mutex);
+    std::copy(m_corr.begin(), m_corr.end(), corr);
+}
+
+bool CorrectionTable::Update(const std::vector<unsigned> &axes,
+                             const js_corr *corr, js_corr *all)
+{
+    Lock l(m_mutex);
+    bool changed = false;
+    for (unsigned i = 0; i < axes.size(); ++i)
+    {
+        if (axes[i] >= m_corr.size() ||
+            SameCorrection(m_corr[axes[i]], corr[i]))
+            continue;
+        m_corr[axes[i]] = corr[i];
+        changed = true;
+    }
+    if (changed && m_fd >= 0)
+        ioctl(m_fd, JSIOCSCORR, &m_corr[0]);
+    if (all)
+        std::copy(m_corr.begin(), m_corr.end(), all);
+    return changed;
+}
+
+MergedJoystick::MergedJoystick(const std::vector<JoystickPtr> &parts)
+    : m_parts(parts)
+{
+    for (unsigned p = 0; p < m_parts.size(); ++p)
+    {
+        const Joystick &part = *m_parts[p];
+        if (p)
+            m_name += " + ";
+        m_name += part.GetName();
+        
+        m_firstButton.push_back(m_buttons.size());
+        m_firstAxis.push_back(m_axes.size());
+        for (unsigned i = 0; i < part.NumButtons(); ++i)
+            m_buttons.push_back(part.GetButton(i));
+        for (unsigned i = 0; i < part.NumAxes(); ++i)
+            m_axes.push_back(part.GetAxis(i));
+    }
+    m_firstButton.push_back(m_buttons.size());
+    m_firstAxis.push_back(m_axes.size());
+}
+
+std::string MergedJoystick::Alias(const std::vector<unsigned> &first,
+                                  unsigned i)
+{
+    // The last part starting at or before i, as an empty part starts where
+    // the next one does
+    unsigned part = std::upper_bound(first.begin(), first.end(), i) -
+                    first.begin() - 1;
+    return boost::lexical_cast<std::string>(part) + ':' +
+           boost::lexical_cast<std::string>(i - first[part]);
+}
+
+std::string MergedJoystick::ButtonAlias(unsigned i) const
+{
+    return Alias(m_firstButton, i);
+}
+
+std::string MergedJoystick::AxisAlias(unsigned i) const
+{
+    return Alias(m_firstAxis, i);
+}
+
+void MergedJoystick::GetCorrection(js_corr *corr) const
+{
+    for (unsigned p = 0; p < m_parts.size(); ++p)
+        m_parts[p]->GetCorrection(corr + m_firstAxis[p]);
+}
+
+void MergedJoystick::SetCorrection(const js_corr *corr)
+{
+    // Each part only passes its share on to the device if it's changed
+    for (unsigned p = 0; p < m_parts.size(); ++p)
+        m_parts[p]->SetCorrection(corr + m_firstAxis[p]);
+}
+
+bool MergedJoystick::UpdateCorrection(const std::vector<unsigned> &axes,
+                                      const js_corr *corr, js_corr *all)
+{
+    // Each part gets its own share (if any) to update in one go
+    bool changed = false;
+    for (unsigned p = 0; p < m_parts.size(); ++p)
+    {
+        std::vector<unsigned> partAxes;
+        std::vector<js_corr> partCorr;
+        for (unsigned i = 0; i < axes.size(); ++i)
+        {
+            if (axes[i] < m_firstAxis[p] || axes[i] >= m_firstAxis[p + 1])
+                continue;
+            partAxes.push_back(axes[i] - m_firstAxis[p]);
+            partCorr.push_back(corr[i]);
+        }
+        if (m_parts[p]->UpdateCorrection(partAxes,
+                                         partCorr.empty() ? 0 : &partCorr[0],
+                                         all ? all + m_firstAxis[p] : 0))
+            changed = true;
+    }
+    return changed;
+}
+
+bool Joystick::UpdateCorrection(const std::vector<unsigned> &axes,
+                                const js_corr *corr, js_corr *all)
+{
+    boost::scoped_array<js_corr> table(new js_corr[NumAxes()]());
+    GetCorrection(table.get());
+    bool changed = false;
+    for (unsigned i = 0; i < axes.size(); ++i)
+    {
+        if (axes[i] >= NumAxes() || SameCorrection(table[axes[i]], corr[i]))
+            continue;
+        table[axes[i]] = corr[i];
+        changed = true;
+    }
+    if (changed)
+        SetCorrection(table.get());
+    if (all)
+        std::copy(table.get(), table.get() + NumAxes(), all);
+    return changed;
 }
 
 void Joystick::Calibrate(CalibrationPtr cal)
 {
-    boost::scoped_array<js_corr> corr(new js_corr[NumAxes()]());
-    GetCorrection(corr.get());
+    std::vector<unsigned> axes;
+    std::vector<js_corr> corr;
     BOOST_FOREACH (Calibration::value_type &c, *cal)
     {
         if (c.first >= NumAxes())
             continue;
-        corr[c.first] = c.second;
+        axes.push_back(c.first);
+        corr.push_back(c.second);
     }
-    SetCorrection(corr.get());
+    if (!axes.empty())
+        UpdateCorrection(axes, &corr[0]);
 }
@@ -13,13 +13,41 @@
 #include <boost/bind.hpp>
 #include <boost/signals2.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <pthread.h>
 #include <vector>
 #include <map>
 #include <set>
+#include <algorithm>
 
 typedef std::vector<__u16> ButtonMap;
 typedef std::vector<__u8> AxisMap;
 
+// The order in which events are presented on the virtual joystick
+struct EventOrder {
+    bool operator()(const js_event &a, const js_event &b) const {
+        if (a.time != b.time) return a.time < b.time;
+        if (a.type != b.type) return a.type < b.type;
+        if (a.number != b.number) return a.number < b.number;
+        return false;
+    }
+};
+
+// Put the events resulting from one input event into EventOrder. This is a
+// stable insertion sort: frames are short and usually already in order, and
+// it doesn't allocate.
+inline void SortFrame(js_event *first, js_event *last)
+{
+    EventOrder less;
+    for (js_event *i = first + 1; i < last; ++i)
+    {
+        js_event e = *i;
+        js_event *j = i;
+        for (; j > first && less(e, j[-1]); --j)
+            *j = j[-1];
+        *j = e;
+    }
+}
+
 typedef boost::signals2::signal<void (__u32 time,
                                       __s16 value,
                                       bool init)> ChangeSig;
@@ -68,9 +96,16 @@ class Button : public InputBase
 {
     __u16     m_mapping;
     unsigned  m_order;
+    unsigned  m_id;
     __s16     m_value;
     bool      m_initialised;
     
+    static unsigned AllocateId();
+    static void FreeId(unsigned id);
+    
+    Button(const Button &);
+    Button &operator=(const Button &);
+    
 public:
     virtual void Input(__u32 time, __s16 value, bool init) {
         if (!m_initialised)
@@ -89,13 +124,19 @@ public:
     virtual __s16 GetValue()   const { return m_value; }
     virtual unsigned GetOrder() const { return m_order; }
     
+    // Small and dense among live buttons, for ButtonSet
+    unsigned Id() const { return m_id; }
+    
     Button(__u16 mapping = BTN_MISC, unsigned order = 0)
         : m_mapping(mapping),
           m_order(order),
+          m_id(AllocateId()),
           m_value(0),
           m_initialised(false)
     {
     }
+    
+    ~Button() { FreeId(m_id); }
 };
 typedef boost::shared_ptr<Button> ButtonPtr;
 
@@ -113,14 +154,131 @@ struct ButtonOrder
     }
 };
 
+// A set of buttons, iterated in ButtonOrder. Membership is a bitset over
+// Button::Id(), so tests and whole-set operations work a word at a time
+// rather than comparing and allocating a tree node per button. Inserting
+// appends to a list that is put in order when next iterated, and erasing
+// only clears a bit until enough have gone to be worth tidying up, so sets
+// can be built or whittled down one button at a time. Null buttons are never
+// members.
+class ButtonSet
+{
+    typedef unsigned long Word;
+    static const unsigned WORD_BITS = sizeof(Word) * 8;
+    
+    // In ButtonOrder up to m_sorted, including erased buttons
+    mutable std::vector<ButtonPtr> m_order;
+    mutable size_t         m_sorted;
+    std::vector<Word>      m_bits;      // by Id()
+    size_t                 m_size;
+    
+    bool Has(unsigned id) const
+    {
+        return id / WORD_BITS < m_bits.size() &&
+            (m_bits[id / WORD_BITS] >> (id % WORD_BITS) & 1);
+    }
+    void Sort() const;
+    void Tidy();
+    
+public:
+    class const_iterator
+    {
+        typedef std::vector<ButtonPtr>::const_iterator Base;
+        const ButtonSet *m_set;
+        Base             m_i;
+        
+        void Skip()
+        {
+            while (m_i != m_set->m_order.end() && !m_set->Has((*m_i)->Id()))
+                ++m_i;
+        }
+        
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef ButtonPtr                 value_type;
+        typedef ptrdiff_t                 difference_type;
+        typedef const ButtonPtr          *pointer;
+        typedef const ButtonPtr          &reference;
+        
+        const_iterator() : m_set(0) {}
+        const_iterator(const ButtonSet *set, Base i) : m_set(set), m_i(i)
+        {
+            Skip();
+        }
+        
+        reference operator*() const { return *m_i; }
+        pointer operator->() const { return &*m_i; }
+        const_iterator &operator++() { ++m_i; Skip(); return *this; }
+        const_iterator operator++(int)
+        {
+            const_iterator old(*this);
+            ++*this;
+            return old;
+        }
+        bool operator==(const const_iterator &o) const { return m_i == o.m_i; }
+        bool operator!=(const const_iterator &o) const { return m_i != o.m_i; }
+    };
+    typedef const_iterator iterator;
+    
+    ButtonSet() : m_sorted(0), m_size(0) {}
+    template <class It> ButtonSet(It first, It last) : m_sorted(0), m_size(0)
+    {
+        insert(first, last);
+    }
+    
+    const_iterator begin() const
+    {
+        Sort();
+        return const_iterator(this, m_order.begin());
+    }
+    const_iterator end() const { return const_iterator(this, m_order.end()); }
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+    
+    size_t count(const ButtonPtr &b) const { return b && Has(b->Id()); }
+    const_iterator find(const ButtonPtr &b) const;
+    
+    void insert(const ButtonPtr &b) { insert(&b, &b + 1); }
+    template <class It> void insert(It first, It last);
+    size_t erase(const ButtonPtr &b);
+    void clear();
+    
+    // Remove everything in 'what', adding whatever was removed to 'removed'.
+    // Returns how many were removed.
+    size_t Remove(const ButtonSet &what, ButtonSet *removed = 0);
+    
+    bool operator==(const ButtonSet &other) const;
+    bool operator!=(const ButtonSet &other) const { return !(*this == other); }
+};
+
+template <class It> void ButtonSet::insert(It first, It last)
+{
+    if (m_order.size() != m_size)
+        Tidy();     // so nothing being added is still in m_order
+    
+    for (; first != last; ++first)
+    {
+        const ButtonPtr &b = *first;
+        if (!b || Has(b->Id()))
+            continue;
+        const unsigned id = b->Id();
+        if (id / WORD_BITS >= m_bits.size())
+            m_bits.resize(id / WORD_BITS + 1, 0);
+        m_bits[id / WORD_BITS] |= Word(1) << (id % WORD_BITS);
+        m_order.push_back(b);
+    }
+    m_size = m_order.size();
+}
+
 typedef std::map<ButtonPtr, ButtonPtr>      ButtonMapping;
 typedef boost::shared_ptr<ButtonMapping>    ButtonMappingPtr;
-typedef std::set<ButtonPtr, ButtonOrder>    ButtonSet;
 typedef boost::shared_ptr<ButtonSet>        ButtonSetPtr;
 typedef std::map<std::string, ButtonSet>    ButtonSetMap;
 typedef std::map<unsigned, js_corr>         Calibration;
 typedef boost::shared_ptr<Calibration>      CalibrationPtr;
 
+class CalibrationWriter;
+
 struct InputContext;
 class ShiftSet;
 typedef boost::shared_ptr<ShiftSet> ShiftSetPtr;
@@ -128,8 +286,15 @@ class ShiftSet : public boost::enable_shared_from_this<ShiftSet>
 {
     
     typedef std::pair<ButtonPtr, __s16> Condition;
-    typedef std::map<Button*, std::vector<ButtonPtr> > ShiftMap;
-    typedef std::map<Condition, std::list<unsigned> > RotationMap;
+    
+    // Identical conditions are cycled between: each press selects the next
+    // set in the list
+    struct Rotation
+    {
+        Condition                condition;
+        std::vector<unsigned>    sets;
+        unsigned                 head;
+    };
     
     struct ConditionState
     {
@@ -137,18 +302,34 @@ class ShiftSet : public boost::enable_shared_from_this<ShiftSet>
         std::vector<ShiftSetPtr> subShifts;
     };
     
+    typedef unsigned long Word;
+    static const unsigned WORD_BITS = sizeof(Word) * 8;
+    
+    friend class MappedJoystick;
+    
     ShiftSet(ButtonSetPtr inputButtons);
     
     void ShiftInput(__u32 time, __s16 value, bool init, __u16 testValue,
-                     std::list<unsigned> &rotations);
+                    unsigned rotation);
     
-    void Input(__u32 time, __s16 value, bool init, Button *inButton);
+    void Input(__u32 time, __s16 value, bool init, unsigned slot);
     
+    // Inputs are numbered by their position in m_inputButtons (their slot).
+    // The output for slot i under condition c is m_outputs[c * size + i].
     ButtonSetPtr                  m_inputButtons;
+    std::vector<ButtonPtr>        m_inputs;
+    std::vector<ButtonPtr>        m_outputs;
     unsigned                      m_currentSet;
-    ShiftMap                      m_shiftMap;
-    RotationMap                   m_rotationMap;
+    std::vector<Rotation>         m_rotations;
+    std::map<Condition, unsigned> m_rotationIndex; // into m_rotations
     std::vector<ConditionState>   m_conditionStates;
+    unsigned long                 m_switches; // times m_currentSet changed
+    
+    // Bitsets by slot: inputs which are pressed, and inputs which haven't
+    // had an init event yet (so their outputs' values aren't known). Only
+    // these need anything doing when the set changes.
+    std::vector<Word>             m_pressed;
+    std::vector<Word>             m_unsettled;
     
 public:
     static boost::shared_ptr<ShiftSet> Create(ButtonSetPtr input);
@@ -156,20 +337,31 @@ public:
     ButtonMappingPtr AddCondition(ButtonPtr button, __s16 state,
                                   const ButtonMapping &sharedButtons,
                                   unsigned &buttonOrder);
+    // As above, but with the output for every input button given
+    void AddCondition(ButtonPtr button, __s16 state,
+                      const ButtonMapping &outputs);
     void SetSubShifts(const std::vector<ShiftSetPtr> &shifts);
+    void SetSubShifts(unsigned condition,
+                      const std::vector<ShiftSetPtr> &shifts);
     
     void AllOutputs(ButtonSet &outputs) const;
     ButtonSetPtr Inputs() const { return m_inputButtons; }
+    unsigned long Switches() const { return m_switches; }
 };
 
 class HatButton : public Button
 {
+    const unsigned m_axis;     // index of axis on the input joystick
     const bool m_positive; // button is pressed when axis positive or negative?
-    HatButton(bool positive) : m_positive(positive) { }
+    HatButton(unsigned axisIndex, bool positive)
+        : m_axis(axisIndex), m_positive(positive) { }
 public:
-    static boost::shared_ptr<HatButton> Create(AxisPtr axis, bool positive)
+    static boost::shared_ptr<HatButton> Create(AxisPtr axis,
+                                               unsigned axisIndex,
+                                               bool positive)
     {
-        boost::shared_ptr<HatButton> button(new HatButton(positive));
+        boost::shared_ptr<HatButton> button(new HatButton(axisIndex,
+                                                          positive));
         axis->Connect(ChangeSig::slot_type(&HatButton::Input, button.get(),
                                            _1, _2, _3).track(button));
         return button;
@@ -180,6 +372,9 @@ public:
         __s16 pressed = (m_positive ? value : -value) > 0 ? 1 : 0;
         Button::Input(time, pressed, init);
     }
+    
+    unsigned AxisIndex() const { return m_axis; }
+    bool     Positive()  const { return m_positive; }
 };
 
 class Joystick
@@ -197,8 +392,19 @@ public:
     virtual void GetCorrection(js_corr *) const = 0;
     virtual void SetCorrection(const js_corr *) = 0;
     
+    // Set the correction of each of 'axes' to the matching one of 'corr',
+    // leaving the other axes' as they are, and copy the whole table to 'all'
+    // if given. Returns whether anything changed. Joysticks whose tables
+    // are shared do this in one go.
+    virtual bool UpdateCorrection(const std::vector<unsigned> &axes,
+                                  const js_corr *corr, js_corr *all = 0);
+    
     virtual void Calibrate(CalibrationPtr);
     
+    // Another name for button or axis i in config files, or "" if none
+    virtual std::string ButtonAlias(unsigned) const { return std::string(); }
+    virtual std::string AxisAlias(unsigned) const { return std::string(); }
+    
     virtual ~Joystick() {};
 };
 typedef boost::shared_ptr<Joystick> JoystickPtr;
@@ -208,6 +414,7 @@ typedef boost::function<ButtonSetPtr (const std::string &)> LookupFn;
 struct InputContext
 {
     std::vector<AxisPtr> axes;
+    std::map<std::string, unsigned> axisNames; // aliases -> index in axes
     ButtonSetMap         buttons;
     unsigned             buttonOrder;
     ButtonSet            conditionals;
@@ -216,15 +423,84 @@ struct InputContext
     InputContext() : buttonOrder(0) {}
 };
 
+// A flattened description of a MappedJoystick: everything needed to rebuild
+// it without going back to the XML. Buttons are referred to by index into
+// 'nodes', ShiftSets by index into 'shifts'.
+struct MapTables
+{
+    enum NodeKind { NODE_INPUT, NODE_HAT, NODE_SHIFTED };
+    enum Flags { COALESCE_AXES = 1 };
+    
+    struct Node
+    {
+        __u8      kind;
+        __u8      positive;   // NODE_HAT: pressed when axis is positive?
+        __u16     mapping;    // NODE_SHIFTED
+        __u32     index;      // input button (NODE_INPUT) or axis (NODE_HAT)
+        __u32     order;      // NODE_SHIFTED
+    };
+    struct Shift
+    {
+        __u32     firstInput, numInputs;         // into shiftInputs
+        __u32     firstCondition, numConditions; // into conditions
+    };
+    struct Condition
+    {
+        __u32     button;
+        __s16     state;
+        __u16     reserved;
+        __u32     firstOutput;       // into conditionOutputs, one per input
+        __u32     firstSub, numSubs; // into subShifts
+    };
+    struct Correction
+    {
+        __u32     axis;
+        js_corr   corr;
+    };
+    
+    std::vector<Node>       nodes;
+    std::vector<Shift>      shifts;  // parents come before their subshifts
+    std::vector<Condition>  conditions;
+    std::vector<__u32>      shiftInputs;
+    std::vector<__u32>      conditionOutputs;
+    std::vector<__u32>      subShifts;
+    std::vector<__u32>      rootShifts;
+    std::vector<__u32>      buttons; // output buttons
+    std::vector<__u32>      axes;    // output axes, as input axis indices
+    std::vector<Correction> calibration;
+    __u32                   flags;
+    
+    MapTables() : flags(0) {}
+};
+
 class MappedJoystick : public Joystick
 {
     std::vector<ButtonPtr> m_buttons;
     std::vector<unsigned>  m_axes; // indices into axes in m_in
     JoystickPtr            m_in;
-    const char            *m_configOut;
     
     std::vector<ShiftSetPtr>  m_shifts;
-    boost::shared_ptr<xmlDoc> m_xmlDoc;
+    Calibration               m_calibration; // from the config file
+    bool                      m_coalesceAxes;
+    
+    // Saves calibrations set through us to the output config file, if any
+    boost::shared_ptr<CalibrationWriter> m_calibrationWriter;
+    
+    // The whole of m_in's correction table as of our last SetCorrection, to
+    // be saved. Guarded by m_corrMutex, which keeps saves in order.
+    std::vector<js_corr>      m_corrToSave;
+    pthread_mutex_t           m_corrMutex;
+    
+    // Node of each button lowered so far, and index of each input button
+    typedef std::map<const Button*, __u32> NodeIds;
+    struct Lowering
+    {
+        NodeIds nodes, inputs;
+    };
+    __u32 LowerButton(const ButtonPtr &b, MapTables &t, Lowering &l) const;
+    __u32 LowerShift(const ShiftSet &ss, MapTables &t, Lowering &l) const;
+    static void ShiftSwitches(const ShiftSet &ss,
+                              std::vector<unsigned long> &switches);
     
 public: 
     virtual unsigned    NumAxes() const { return m_axes.size(); }
@@ -235,17 +511,64 @@ public:
     virtual void SetCorrection(const js_corr *);
     virtual AxisPtr GetAxis(unsigned i) const;
     
+    // Should a reader that has fallen behind only be given the latest value
+    // of each axis? Set by coalesce_axes="true" on the root element.
+    bool CoalesceAxes() const { return m_coalesceAxes; }
+    
+    // Describe this joystick's mapping as flat tables
+    void Lower(MapTables &tables) const;
+    
+    // Number of times each shift has changed set, in the same order as
+    // MapTables::shifts
+    void ShiftSwitches(std::vector<unsigned long> &switches) const;
+    
     MappedJoystick(JoystickPtr in, const char *mapfile, const char *corrfile);
+    
+    // Build from tables produced by Lower(). The mapfile is only read if the
+    // calibration needs writing out.
+    MappedJoystick(JoystickPtr in, const MapTables &tables,
+                   const char *mapfile, const char *corrfile);
+    ~MappedJoystick();
 };
+typedef boost::shared_ptr<MappedJoystick> MappedJoystickPtr;
+
+// A real joystick's correction table, read from it once and then kept up to
+// date here rather than asked for on every GetCorrection. There should be one
+// per device, shared by everything that maps it, so that none of them sees a
+// stale table. Guarded by its own mutex, as ioctls can arrive on several
+// threads at once.
+class CorrectionTable
+{
+    int                     m_fd;       // our own dup, so it can't be reused
+                                        // for another file while we hold it
+    std::vector<js_corr>    m_corr;
+    mutable pthread_mutex_t m_mutex;
+    
+public:
+    explicit CorrectionTable(int fd);
+    ~CorrectionTable();
+    
+    unsigned Size() const { return m_corr.size(); }
+    void Get(js_corr *) const;
+    
+    // As Joystick::UpdateCorrection. The device is only told if the table
+    // changes.
+    bool Update(const std::vector<unsigned> &axes, const js_corr *corr,
+                js_corr *all);
+};
+typedef boost::shared_ptr<CorrectionTable> CorrectionTablePtr;
 
 class InputJoystick : public Joystick
 {
     std::vector<ButtonPtr> m_buttons;
     std::vector<AxisPtr>   m_axes;
-    int                    m_fd;
+    CorrectionTablePtr     m_corr;
     
 public:
-    InputJoystick(int fd);
+    // 'firstOrder' is the GetOrder() of button 0; the rest follow on. 'corr'
+    // is the device's correction table, if it already has one.
+    InputJoystick(int fd, unsigned firstOrder = 0,
+                  CorrectionTablePtr corr = CorrectionTablePtr());
     
     virtual std::string GetName() const { return m_name; }
     virtual unsigned    NumAxes() const { return m_axes.size(); }
@@ -254,6 +577,41 @@ public:
     virtual ButtonPtr   GetButton(unsigned i) const { return m_buttons[i]; }
     virtual void GetCorrection(js_corr *) const;
     virtual void SetCorrection(const js_corr *);
+    virtual bool UpdateCorrection(const std::vector<unsigned> &axes,
+                                  const js_corr *corr, js_corr *all = 0);
+};
+
+// Several joysticks presented as one: the buttons of each in turn, then the
+// axes of each. Config files number them from 0 across all of the parts, and
+// can also call button or axis N of part D (from 0) "D:N".
+class MergedJoystick : public Joystick
+{
+    std::vector<JoystickPtr> m_parts;
+    std::vector<unsigned>  m_firstButton; // per part, then the total
+    std::vector<unsigned>  m_firstAxis;
+    std::vector<ButtonPtr> m_buttons;
+    std::vector<AxisPtr>   m_axes;
+    
+    // "D:N" for index i in 'first'
+    static std::string Alias(const std::vector<unsigned> &first, unsigned i);
+    
+public:
+    explicit MergedJoystick(const std::vector<JoystickPtr> &parts);
+    
+    unsigned NumParts() const { return m_parts.size(); }
+    unsigned FirstButton(unsigned part) const { return m_firstButton[part]; }
+    unsigned FirstAxis(unsigned part) const   { return m_firstAxis[part]; }
+    
+    virtual unsigned    NumAxes() const { return m_axes.size(); }
+    virtual unsigned    NumButtons() const { return m_buttons.size(); }
+    virtual AxisPtr     GetAxis(unsigned i) const { return m_axes[i]; }
+    virtual ButtonPtr   GetButton(unsigned i) const { return m_buttons[i]; }
+    virtual void GetCorrection(js_corr *) const;
+    virtual void SetCorrection(const js_corr *);
+    virtual bool UpdateCorrection(const std::vector<unsigned> &axes,
+                                  const js_corr *corr, js_corr *all = 0);
+    virtual std::string ButtonAlias(unsigned i) const;
+    virtual std::string AxisAlias(unsigned i) const;
 };
 
 #endif
@@ -0,0 +1,226 @@
+/* (c) Peter Chapman 2010
+   Licensed under the GNU General Public Licence; either version 2 or (at your
+   option) any later version
+*/
+#include "mapcache.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <iostream>
+#include <boost/make_shared.hpp>
+
+namespace {
+
+// Bump the version whenever MapTables or the meaning of its contents changes
+const char  s_magic[4] = { 'S', 'S', 'M', 'C' };
+const __u32 s_version  = 2;
+
+enum Section {
+    SEC_NODES, SEC_SHIFTS, SEC_CONDITIONS, SEC_SHIFT_INPUTS,
+    SEC_CONDITION_OUTPUTS, SEC_SUB_SHIFTS, SEC_ROOT_SHIFTS, SEC_BUTTONS,
+    SEC_AXES, SEC_CALIBRATION, NUM_SECTIONS
+};
+
+struct CacheHeader
+{
+    char  magic[4];
+    __u32 version;
+    __u64 configMtime;   // nanoseconds
+    __u64 configSize;
+    __u64 joystickHash;
+    __u32 counts[NUM_SECTIONS];
+    __u32 flags;         // MapTables::flags
+};
+
+// FNV-1a
+__u64 Hash(__u64 h, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+__u64 JoystickHash(const Joystick &in)
+{
+    __u64 h = 0xcbf29ce484222325ULL;
+    std::string name = in.GetName();
+    h = Hash(h, name.data(), name.size());
+
+    __u32 counts[2] = { in.NumButtons(), in.NumAxes() };
+    h = Hash(h, counts, sizeof(counts));
+    for (unsigned i = 0; i < in.NumButtons(); ++i)
+    {
+        __u16 mapping = in.GetButton(i)->GetMapping();
+        h = Hash(h, &mapping, sizeof(mapping));
+    }
+    for (unsigned i = 0; i < in.NumAxes(); ++i)
+    {
+        __u8 mapping = in.GetAxis(i)->GetMapping();
+        h = Hash(h, &mapping, sizeof(mapping));
+    }
+    return h;
+}
+
+bool ConfigStamp(const char *mapfile, CacheHeader &header)
+{
+    struct stat s;
+    if (stat(mapfile, &s) != 0)
+        return false;
+    header.configMtime = __u64(s.st_mtim.tv_sec) * 1000000000ULL
+                       + s.st_mtim.tv_nsec;
+    header.configSize = s.st_size;
+    return true;
+}
+
+size_t Padded(size_t bytes) { return (bytes + 7) & ~size_t(7); }
+
+template <class T>
+bool ReadSection(const char *&p, const char *end, __u32 count,
+                 std::vector<T> &v)
+{
+    size_t bytes = size_t(count) * sizeof(T);
+    if (size_t(end - p) < bytes)
+        return false;
+    const T *first = (const T *)p;
+    v.assign(first, first + count);
+    p += std::min(Padded(bytes), size_t(end - p));
+    return true;
+}
+
+template <class T>
+void WriteSection(std::string &out, const std::vector<T> &v)
+{
+    size_t bytes = v.size() * sizeof(T);
+    if (bytes)
+        out.append((const char *)&v[0], bytes);
+    out.append(Padded(bytes) - bytes, '\0');
+}
+
+}
+
+bool ReadMapCache(const char *cacheFile, const char *mapfile,
+                  const Joystick &in, MapTables &t)
+{
+    CacheHeader expected = CacheHeader();
+    if (!ConfigStamp(mapfile, expected))
+        return false;
+
+    int fd = open(cacheFile, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat s;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &s) == 0 && size_t(s.st_size) >= sizeof(CacheHeader))
+        map = mmap(0, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    const char *p = (const char *)map, *end = p + s.st_size;
+    const CacheHeader &h = *(const CacheHeader *)p;
+    p += sizeof(CacheHeader);
+
+    bool ok = memcmp(h.magic, s_magic, sizeof(s_magic)) == 0 &&
+              h.version == s_version &&
+              h.configMtime == expected.configMtime &&
+              h.configSize == expected.configSize &&
+              h.joystickHash == JoystickHash(in);
+
+    t.flags = h.flags;
+    ok = ok &&
+        ReadSection(p, end, h.counts[SEC_NODES],      t.nodes) &&
+        ReadSection(p, end, h.counts[SEC_SHIFTS],     t.shifts) &&
+        ReadSection(p, end, h.counts[SEC_CONDITIONS], t.conditions) &&
+        ReadSection(p, end, h.counts[SEC_SHIFT_INPUTS], t.shiftInputs) &&
+        ReadSection(p, end, h.counts[SEC_CONDITION_OUTPUTS],
+                    t.conditionOutputs) &&
+        ReadSection(p, end, h.counts[SEC_SUB_SHIFTS],  t.subShifts) &&
+        ReadSection(p, end, h.counts[SEC_ROOT_SHIFTS], t.rootShifts) &&
+        ReadSection(p, end, h.counts[SEC_BUTTONS],     t.buttons) &&
+        ReadSection(p, end, h.counts[SEC_AXES],        t.axes) &&
+        ReadSection(p, end, h.counts[SEC_CALIBRATION], t.calibration);
+
+    munmap(map, s.st_size);
+    return ok;
+}
+
+bool WriteMapCache(const char *cacheFile, const char *mapfile,
+                   const Joystick &in, const MapTables &t)
+{
+    CacheHeader h = CacheHeader();
+    if (!ConfigStamp(mapfile, h))
+        return false;
+    memcpy(h.magic, s_magic, sizeof(s_magic));
+    h.version = s_version;
+    h.joystickHash = JoystickHash(in);
+    h.counts[SEC_NODES]             = t.nodes.size();
+    h.counts[SEC_SHIFTS]            = t.shifts.size();
+    h.counts[SEC_CONDITIONS]        = t.conditions.size();
+    h.counts[SEC_SHIFT_INPUTS]      = t.shiftInputs.size();
+    h.counts[SEC_CONDITION_OUTPUTS] = t.conditionOutputs.size();
+    h.counts[SEC_SUB_SHIFTS]        = t.subShifts.size();
+    h.counts[SEC_ROOT_SHIFTS]       = t.rootShifts.size();
+    h.counts[SEC_BUTTONS]           = t.buttons.size();
+    h.counts[SEC_AXES]              = t.axes.size();
+    h.counts[SEC_CALIBRATION]       = t.calibration.size();
+    h.flags = t.flags;
+
+    std::string out((const char *)&h, sizeof(h));
+    WriteSection(out, t.nodes);
+    WriteSection(out, t.shifts);
+    WriteSection(out, t.conditions);
+    WriteSection(out, t.shiftInputs);
+    WriteSection(out, t.conditionOutputs);
+    WriteSection(out, t.subShifts);
+    WriteSection(out, t.rootShifts);
+    WriteSection(out, t.buttons);
+    WriteSection(out, t.axes);
+    WriteSection(out, t.calibration);
+
+    // Write to a temporary file and rename it into place, so that nobody
+    // ever sees a partly written cache
+    std::string tmpName = std::string(cacheFile) + ".XXXXXX";
+    int fd = mkstemp(&tmpName[0]);
+    if (fd < 0)
+        return false;
+
+    bool ok = write(fd, out.data(), out.size()) == ssize_t(out.size());
+    ok = (close(fd) == 0) && ok;
+    ok = ok && rename(tmpName.c_str(), cacheFile) == 0;
+    if (!ok)
+        unlink(tmpName.c_str());
+    return ok;
+}
+
+MappedJoystickPtr LoadMapping(JoystickPtr in, const char *mapfile,
+                              const char *configOut, bool useCache)
+{
+    const std::string cacheFile = std::string(mapfile) + ".cache";
+    MapTables tables;
+
+    if (useCache && ReadMapCache(cacheFile.c_str(), mapfile, *in, tables))
+    {
+        try {
+            return boost::make_shared<MappedJoystick>(in, tables, mapfile,
+                                                      configOut);
+        } catch (const std::exception &e) {
+            std::cerr << cacheFile << ": " << e.what() << '\n';
+        }
+    }
+
+    MappedJoystickPtr joy(new MappedJoystick(in, mapfile, configOut));
+    if (useCache)
+    {
+        joy->Lower(tables);
+        if (!WriteMapCache(cacheFile.c_str(), mapfile, *in, tables))
+            std::cerr << "Couldn't write " << cacheFile << '\n';
+    }
+    return joy;
+}
@@ -0,0 +1,26 @@
+#if !defined(INCLUDED_MAPCACHE_H_)
+#define INCLUDED_MAPCACHE_H_
+
+/* (c) Peter Chapman 2010
+   Licensed under the GNU General Public Licence; either version 2 or (at your
+   option) any later version
+*/
+
+#include "joymodel.h"
+
+// The compiled mapping for an XML config file is cached next to it (in
+// "<config>.cache"). The cache is only used if it was built from a config file
+// with the same modification time and size, for an input joystick with the
+// same name, buttons and axes.
+
+// Build a MappedJoystick for 'in' from mapfile, using the cache if it's up to
+// date and (re)writing it if it isn't.
+MappedJoystickPtr LoadMapping(JoystickPtr in, const char *mapfile,
+                              const char *configOut, bool useCache = true);
+
+bool ReadMapCache(const char *cacheFile, const char *mapfile,
+                  const Joystick &in, MapTables &tables);
+bool WriteMapCache(const char *cacheFile, const char *mapfile,
+                   const Joystick &in, const MapTables &tables);
+
+#endif
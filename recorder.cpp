@@ -0,0 +1,194 @@
+/* (c) Peter Chapman 2010
+   Licensed under the GNU General Public Licence; either version 2 or (at your
+   option) any later version
+*/
+#include "recorder.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <stdexcept>
+
+namespace {
+
+const __u32 s_queueSize = 65536;
+const int s_flushMs = 100;  // in case a Flush() never arrives
+
+struct Lock {
+    pthread_mutex_t &mutex;
+    Lock(pthread_mutex_t &mutex) : mutex(mutex) { pthread_mutex_lock(&mutex); }
+    ~Lock() { pthread_mutex_unlock(&mutex); }
+};
+
+}
+
+Recorder::Recorder(const char *path)
+    : m_fd(open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)),
+      m_end(sizeof(RecordHeader)),
+      m_header(RecordHeader()),
+      m_headerDirty(0),
+      m_slots(s_queueSize),
+      m_mask(s_queueSize - 1),
+      m_tail(0),
+      m_head(0),
+      m_dropped(0)
+{
+    if (m_fd < 0)
+        throw std::runtime_error("Can't open recording file");
+    
+    // Carry on with an existing recording, dropping any partly written event
+    struct stat s;
+    if (fstat(m_fd, &s) == 0 &&
+        pread(m_fd, &m_header, sizeof(m_header), 0) == sizeof(m_header) &&
+        IsRecording(&m_header, s.st_size))
+    {
+        m_end = s.st_size - (s.st_size - sizeof(RecordHeader))
+                            % sizeof(RecordedEvent);
+    }
+    else
+    {
+        m_header = RecordHeader();
+        memcpy(m_header.magic, "SSRC", 4);
+        m_header.version = RecordHeader::VERSION;
+        m_header.recordSize = sizeof(RecordedEvent);
+        if (ftruncate(m_fd, 0) != 0 ||
+            pwrite(m_fd, &m_header, sizeof(m_header), 0) != sizeof(m_header))
+        {
+            close(m_fd);
+            throw std::runtime_error("Can't write recording file");
+        }
+    }
+    
+    for (__u32 i = 0; i < m_slots.size(); ++i)
+        m_slots[i].seq = i;
+    pthread_mutex_init(&m_headerMutex, NULL);
+    
+    if (pthread_create(&m_thread, NULL, &Recorder::threadproc, this) != 0)
+    {
+        close(m_fd);
+        throw std::runtime_error("Can't create recording thread");
+    }
+}
+
+Recorder::~Recorder()
+{
+    m_wakeup.Exit();
+    pthread_join(m_thread, 0);
+    close(m_fd);
+    if (m_dropped)
+        std::cerr << "recording dropped " << m_dropped << " events\n";
+}
+
+int Recorder::AddDevice(const std::string &name)
+{
+    Lock l(m_headerMutex);
+    for (unsigned i = 0; i < m_header.numDevices; ++i)
+        if (name == m_header.devices[i])
+            return i;
+    
+    if (m_header.numDevices == RecordHeader::MAX_DEVICES ||
+        name.size() >= RecordHeader::NAME_LEN)
+    {
+        return -1;
+    }
+    
+    unsigned id = m_header.numDevices++;
+    strcpy(m_header.devices[id], name.c_str());
+    __sync_lock_test_and_set(&m_headerDirty, 1);
+    m_wakeup.Notify();
+    return id;
+}
+
+void Recorder::Record(int device, __u64 stamp, const js_event &e)
+{
+    if (device < 0)
+        return;
+    
+    // Claim a slot, unless the queue is full
+    __u32 pos = m_tail;
+    Slot *slot;
+    for (;;)
+    {
+        slot = &m_slots[pos & m_mask];
+        __s32 diff = __s32(slot->seq - pos);
+        if (diff == 0)
+        {
+            if (__sync_bool_compare_and_swap(&m_tail, pos, pos + 1))
+                break;
+            pos = m_tail;
+        }
+        else if (diff < 0)
+        {
+            __sync_fetch_and_add(&m_dropped, 1);
+            return;
+        }
+        else
+            pos = m_tail;
+    }
+    
+    RecordedEvent r = { stamp, e, __u32(device), 0 };
+    slot->event = r;
+    __sync_synchronize();
+    slot->seq = pos + 1;    // ready for the writer
+}
+
+void Recorder::WriteHeader()
+{
+    if (!__sync_fetch_and_and(&m_headerDirty, 0))
+        return;
+    
+    RecordHeader h;
+    {
+        Lock l(m_headerMutex);
+        h = m_header;
+    }
+    if (pwrite(m_fd, &h, sizeof(h), 0) != sizeof(h))
+        std::cerr << "Can't write recording header\n";
+}
+
+void Recorder::WriteOut()
+{
+    RecordedEvent buf[256];
+    for (;;)
+    {
+        unsigned n = 0;
+        for (; n < sizeof(buf) / sizeof(buf[0]); ++n, ++m_head)
+        {
+            Slot &slot = m_slots[m_head & m_mask];
+            if (slot.seq != m_head + 1)
+                break;
+            __sync_synchronize();
+            buf[n] = slot.event;
+            __sync_synchronize();
+            slot.seq = m_head + m_slots.size(); // free for reuse
+        }
+        
+        // Any device these events came from was added before they were
+        // recorded, so get it into the header before they reach the file
+        WriteHeader();
+        if (n == 0)
+            return;
+        
+        const size_t bytes = n * sizeof(RecordedEvent);
+        if (pwrite(m_fd, buf, bytes, m_end) == ssize_t(bytes))
+            m_end += bytes;
+        else
+            __sync_fetch_and_add(&m_dropped, n);
+    }
+}
+
+void *Recorder::threadproc(void *data)
+{
+    Recorder &r = *(Recorder*)data;
+    pollfd pfd = { r.m_wakeup.WaitFd(), POLLIN, 0 };
+    while (!r.m_wakeup.Exiting())
+    {
+        poll(&pfd, 1, s_flushMs);
+        r.m_wakeup.Consume();
+        r.WriteOut();
+    }
+    r.WriteOut();
+    return 0;
+}
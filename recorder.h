@@ -0,0 +1,100 @@
+#if !defined(INCLUDED_RECORDER_H_)
+#define INCLUDED_RECORDER_H_
+
+/* (c) Peter Chapman 2010
+   Licensed under the GNU General Public Licence; either version 2 or (at your
+   option) any later version
+*/
+
+#include <linux/joystick.h>
+#include <pthread.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "wakeup.h"
+
+// A recording (--record) is a RecordHeader followed by any number of
+// RecordedEvents, all in host byte order, so the whole file can be mmap'd
+// and used in place. Events are only ever appended; the header is rewritten
+// when a device is added.
+
+struct RecordHeader
+{
+    enum { MAX_DEVICES = 15, NAME_LEN = 64, VERSION = 1 };
+    
+    char      magic[4];     // "SSRC"
+    __u32     version;
+    __u32     recordSize;   // sizeof(RecordedEvent)
+    __u32     numDevices;
+    char      devices[MAX_DEVICES][NAME_LEN]; // input device paths
+    char      reserved[48];
+};
+
+struct RecordedEvent
+{
+    __u64     stamp;        // MonotonicNs() when read from the device
+    js_event  event;        // exactly as read
+    __u32     device;       // index into RecordHeader::devices
+    __u32     reserved;
+};
+
+// Is this (mmap'd) data a recording?
+inline bool IsRecording(const void *data, size_t size)
+{
+    const RecordHeader &h = *(const RecordHeader *)data;
+    return size >= sizeof(RecordHeader) &&
+           memcmp(h.magic, "SSRC", 4) == 0 &&
+           h.version == RecordHeader::VERSION &&
+           h.recordSize == sizeof(RecordedEvent) &&
+           h.numDevices <= RecordHeader::MAX_DEVICES;
+}
+
+// Appends raw input events to a recording. Record() and AddDevice() can be
+// called from any thread and never block on I/O: events go into a fixed-size
+// queue, which a thread of our own writes out along with any header changes.
+// If that falls behind, events are dropped (and counted) rather than waited
+// for.
+class Recorder
+{
+    struct Slot
+    {
+        volatile __u32 seq;   // Vyukov's bounded queue: tells us whose turn
+        RecordedEvent  event;
+    };
+    
+    int               m_fd;
+    off_t             m_end;     // where the next event is written
+    RecordHeader      m_header;
+    pthread_mutex_t   m_headerMutex;
+    volatile int      m_headerDirty; // writer thread should rewrite header?
+    
+    std::vector<Slot> m_slots;
+    __u32             m_mask;
+    volatile __u32    m_tail;    // next slot to fill
+    __u32             m_head;    // next slot to write out (writer thread only)
+    volatile unsigned long m_dropped;
+    
+    Wakeup            m_wakeup;
+    pthread_t         m_thread;
+    
+    void WriteHeader();
+    void WriteOut();
+    static void *threadproc(void *data);
+    
+public:
+    // Appends to 'path' if it's already a recording; otherwise creates it.
+    // Throws on failure.
+    explicit Recorder(const char *path);
+    ~Recorder();
+    
+    // Id to record events from input device 'name' under, or -1 if there are
+    // too many
+    int AddDevice(const std::string &name);
+    
+    void Record(int device, __u64 stamp, const js_event &e);
+    
+    // Have the writer thread write out what's been recorded so far
+    void Flush() { m_wakeup.Notify(); }
+};
+
+#endif
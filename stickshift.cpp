@@ -12,25 +12,40 @@
 #include <fuse_opt.h>
 #include <fuse.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <errno.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
 #include <linux/joystick.h>
 #include <libxml/parser.h>
 #include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/format.hpp>
 #include <boost/bind.hpp>
+#include <algorithm>
 #include <map>
-#include <deque>
+#include <set>
 #include <string>
 #include <iostream>
+#include <sstream>
 #include <vector>
 #include <stdexcept>
-#include "waitpipe.h"
+#include "wakeup.h"
 #include "joymodel.h"
+#include "mapcache.h"
+#include "flatmap.h"
+#include "eventring.h"
+#include "histogram.h"
+#include "recorder.h"
 
 struct stickshift_param {
         int             major;
@@ -39,9 +54,24 @@ struct stickshift_param {
         const char     *outdev;
         const char     *configfile;
         const char     *calibratedfile;
+        int             nocache;
+        int             noreload;
+        int             flat;
+        int             flatten;
+        unsigned        queue;
+        const char     *overflow;
+        const char     *stats;
+        const char     *record;
         int             is_help;
 } g_params = stickshift_param();
 
+// What to do when a reader falls more than g_params.queue events behind
+enum OverflowPolicy {
+    OVERFLOW_DROP,      // lose the oldest events
+    OVERFLOW_COALESCE,  // lose the oldest button events, but not axis positions
+    OVERFLOW_RESYNC     // lose them all, and resend the whole state as INIT
+} s_overflow = OVERFLOW_DROP;
+
 static const char *usage =
 "usage: stickshift [options]\n"
 "\n"
@@ -49,17 +79,95 @@ static const char *usage =
 "    --help | -h             print this help message\n"
 "    --maj=MAJ | -M MAJ      output joystick device major number\n"
 "    --min=MIN | -m MIN      output joystick device minor number\n"
-"    --indev=DEV | -I DEV    real joystick device\n"
+"    --indev=DEV | -I DEV    real joystick device (give several to merge them\n"
+"                            into one virtual joystick)\n"
 "    --outdev=DEV | -O DEV   use major/minor device numbers from DEV (must \n"
 "                            exist first)\n"
 "    --config=CFG            XML configuration file\n"
 "    --calibrated=CFG        output XML config file (written if virtual\n"
 "                            joystick is calibrated)\n"
+"    --also=MIN:CFG[:DEVS[:CAL]]\n"
+"                            also serve a virtual joystick on minor MIN (of\n"
+"                            the same major), mapped by config CFG from the\n"
+"                            real joysticks DEVS (comma-separated; default,\n"
+"                            or if empty, those given with -I), writing its\n"
+"                            calibration to CAL as for --calibrated. May be\n"
+"                            given more than once\n"
+"    --nocache               don't read or write the compiled config cache\n"
+"                            (CFG.cache)\n"
+"    --noreload              don't reload the config when it changes\n"
+"    --flat                  map events with flat lookup tables compiled from\n"
+"                            the config, rather than boost signals\n"
+"    --flatten               as --flat, and also compile each tree of nested\n"
+"                            shifts into a single state machine\n"
+"    --queue=N               most events kept for a reader that falls behind\n"
+"                            (default 4096)\n"
+"    --overflow=POLICY       when a reader falls further behind than that:\n"
+"                              drop     lose the oldest events (default)\n"
+"                              coalesce lose the oldest button events, then\n"
+"                                       send the latest position of each axis\n"
+"                              resync   lose all of them, then send the whole\n"
+"                                       joystick state as JS_EVENT_INIT\n"
+"    --stats=PATH            report statistics to anyone connecting to the\n"
+"                            unix socket PATH\n"
+"    --record=FILE           append all raw input events to FILE, which\n"
+"                            benchmark --stream can replay\n"
 "\n";
 
 
-pthread_t selectThread;
-WaitPipe wakePipe;
+pthread_t ioThread;
+Wakeup wakeup;
+
+// All real joysticks are watched by ioThread through this. Each JsInput
+// registers its input fds with data.ptr pointing to itself; wakeup and
+// s_signalFd are registered with data.ptr pointing to them.
+int s_epollFd = -1;
+
+// Signals that shut us down. They're blocked in every thread and picked up by
+// ioThread through s_signalFd.
+sigset_t s_exitSignals;
+int s_signalFd = -1;
+
+// Listening for connections from anyone wanting statistics (--stats)
+int s_statsFd = -1;
+
+// Writes out raw input events (--record)
+Recorder *s_recorder;
+
+// Watches the config files and builds a new mapping when one changes, so that
+// ioThread never has to wait for one to be parsed (unless --noreload)
+pthread_t s_reloadThread;
+Wakeup s_reloadWakeup;
+bool s_reloading;
+
+// A virtual joystick that we serve: a cuse device of its own, mapped by its
+// own config from some real joysticks
+struct VirtualDevice
+{
+    unsigned      devMinor;
+    std::string   name;            // stickshift<minor>
+    std::string   indev;           // real joysticks, comma-separated
+    std::string   configFile;
+    std::string   calibratedFile;  // "" for none
+    
+    fuse_session *session;
+    int           multithreaded;
+    // Runs the session loop, and is interrupted (by ioThread) when it's time
+    // to leave it
+    pthread_t     thread;
+    
+    VirtualDevice() : devMinor(0), session(0), multithreaded(0), thread() {}
+};
+
+// The first is the one given by -m/-O; then one for each --also. Fixed before
+// any session starts.
+std::vector<VirtualDevice> s_virtualDevices;
+
+// Number of sessions that have been initialised and not yet destroyed.
+// Everything shared between them is set up by the first and torn down by the
+// last.
+unsigned s_sessionsUp;
+pthread_mutex_t s_sessionsMutex = PTHREAD_MUTEX_INITIALIZER;
 
 // RAII lock for pthread
 struct Lock {
@@ -71,153 +179,1331 @@ struct Lock {
     void unlock() { if (locked) pthread_mutex_unlock(&mutex); locked = false; }
 };
 
-// An object of this type represents an open descriptor on our cuse device. So
-// if two programs open the joystick simultaneously, we get two independent
-// JsFile objects.
-class JsFile
+class JsFile;
+class JsDevice;
+typedef boost::shared_ptr<JsDevice> JsDevicePtr;
+
+// The "real" joysticks (one, or several merged into one) read by ioThread on
+// behalf of every JsDevice mapping them, so that each event is read once
+// however many virtual joysticks it drives
+class JsInput
 {
-    int                  m_fd;       // descriptor of "real" joystick
-    __u32                m_version;
-    std::deque<js_event> m_events;   // output event queue
+public:
+    // An event, numbered among the buttons or axes of all the real
+    // joysticks, and when it was read
+    struct Incoming
+    {
+        js_event e;
+        __u64    read;
+    };
     
-    // outstanding read request, for blocking reads
-    fuse_req_t            m_readReq;
-    size_t                m_readSize; // Size requested
+private:
+    // Paths & descriptors of the real joysticks. A descriptor is -1 once its
+    // joystick has gone away.
+    std::vector<std::string> m_inputDevs;
+    std::vector<int>      m_fds;
+    __u32                 m_version;   // of the first one
+    int                   m_recordId;  // our device in s_recorder
     
-    // used to inform fuse when input is available, if client is doing
-    // select/poll on our device
-    fuse_pollhandle      *m_pollHandle;
-
-    // Sync between fuse thread and selectThread
+    // Each real joystick's correction table, shared by every mapping of it
+    std::vector<CorrectionTablePtr> m_corrections;
+    
+    // Where each real joystick's buttons & axes start among all of them
+    std::vector<unsigned> m_firstButton, m_firstAxis;
+    unsigned              m_numButtons;
+    
+    // The events read in one go, in time order. ioThread only.
+    std::vector<Incoming> m_incoming;
+    
+    // The last event from each button, then axis, of the real joysticks
+    // (type 0 if there's been none), for bringing a new mapping up to date,
+    // and the time of the latest. Written by ioThread with m_mutex held.
+    std::vector<js_event> m_state;
+    __u32                 m_lastTime;
+    
+    // Guards m_fds, m_state and the devices we feed
     pthread_mutex_t       m_mutex;
+    std::vector<JsDevice*> m_devices;
+    bool                  m_watched;   // by s_epollFd yet?
+    
+    // Read everything available into m_incoming
+    void ReadAll();
+    
+public:
+    const std::vector<std::string> &InputDevs() const { return m_inputDevs; }
+    __u32 Version() const { return m_version; }
+    const std::vector<CorrectionTablePtr> &Corrections() const
+    {
+        return m_corrections;
+    }
+    
+    // Our descriptors, and whether none of them has been lost
+    std::vector<int> Fds();
+    bool Complete();
+    
+    // The last event of each input, as for m_state. For ioThread only.
+    const std::vector<js_event> &State() const { return m_state; }
+    
+    // Start or stop feeding our events to 'device'. Attach brings it up to
+    // date with our state first.
+    void Attach(JsDevice *device);
+    void Detach(JsDevice *device);
+    
+    // Called by ioThread when s_epollFd reports 'events' on one of our FDs
+    void ReadAvailable(unsigned events);
+    
+    // 'inputDev' is the path of the real joystick, or a comma-separated list
+    // of them to merge
+    explicit JsInput(const std::string &inputDev);
+    ~JsInput();
+};
+typedef boost::shared_ptr<JsInput> JsInputPtr;
+
+// Everything built from the config file for one real joystick, or several
+// merged into one
+struct Mapping
+{
+    JoystickPtr                      input;
+    MappedJoystickPtr                output;
+    boost::shared_ptr<FlatMapper>    flat;    // with --flat
+    
+    // Replies to the ioctls that describe the virtual joystick, which can't
+    // change while this mapping is in use
+    std::string name;                         // with its NUL, if any
+    __u8        numAxes, numButtons;
+    __u8        axisMap[_IOC_SIZE(JSIOCGAXMAP)];
+    __u16       buttonMap[_IOC_SIZE(JSIOCGBTNMAP) / sizeof(__u16)];
+    
+    // Should readers skip stale axis events? (see MappedJoystick)
+    bool        coalesceAxes;
+    
+    // Room for a JSIOCGCORR reply, which is filled in when asked for as
+    // calibration can change. Guarded by corrMutex.
+    std::vector<js_corr>    corr;
+    pthread_mutex_t         corrMutex;
+    
+    // Fill in the replies from 'output'
+    void Describe();
+    
+    Mapping()  { pthread_mutex_init(&corrMutex, NULL); }
+    ~Mapping() { pthread_mutex_destroy(&corrMutex); }
+};
+typedef boost::shared_ptr<Mapping> MappingPtr;
+
+// Mappings that have been replaced by a reload. ioThread leaves them here
+// for reloadThread to destroy, as a big one can take a while.
+std::vector<MappingPtr> s_retired;
+pthread_mutex_t s_retiredMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// An object of this type represents a virtual joystick: the mapping applied
+// to a JsInput. It is shared by all JsFile objects opened on it. ioThread
+// maps each hardware event once and publishes the result in m_ring, from
+// which every open descriptor reads at its own pace.
+class JsDevice
+{
+    JsInputPtr           m_input;
+    __u32                m_lastTime; // timestamp of most recent input event
+    
+    // Output events. Only ever written by ioThread (and the constructor).
+    EventRing            m_ring;
+    std::vector<js_event> m_batch;   // mapped but not yet published
+    std::vector<EventRing::Stamp> m_batchStamps;
+    
+    // The state of the virtual joystick (buttons, then axes) as of
+    // m_stateHead in m_ring. Written by ioThread along with m_ring, and read
+    // without locking: readers retry if m_stateSeq changes. It's odd while an
+    // update is in progress. Its capacity is reserved up front, so that a
+    // reload which changes its size never moves it under a reader. The
+    // events' times aren't kept up to date: they're all m_stateTime.
+    static const unsigned MAX_STATE = 2 * 256;
+    std::vector<js_event> m_state;
+    __u32                 m_stateHead;
+    __u32                 m_stateTime;
+    volatile unsigned     m_stateSeq;
+    
+    // Latency from reading input to having mapped it, and from then to
+    // publishing the results. Written by ioThread only.
+    Histogram            m_mapLatency;
+    Histogram            m_publishLatency;
+    
+    // Reply latencies (see JsFile) of files that have been closed. Guarded by
+    // m_mutex.
+    Histogram            m_closedQueueLatency;
+    Histogram            m_closedTotalLatency;
+    
+    // Counts of events read from the real joystick, and published for each
+    // button & axis on the virtual one. Written by ioThread only.
+    unsigned long long   m_eventsIn;
+    std::vector<unsigned long long> m_buttonEvents;
+    std::vector<unsigned long long> m_axisEvents;
+    
+    // Open descriptors on our cuse device which want our output
+    std::vector<JsFile*> m_files;
+    
+    // Number of JsFiles using this device. Guarded by s_devicesMutex.
+    unsigned             m_users;
+    friend JsDevicePtr GetDevice(const VirtualDevice &);
+    friend void ReleaseDevice(JsDevice *);
+    friend void SweepDevices();
+    
+    // Sync between fuse threads and ioThread. Guards the joystick models and
+    // m_files, but not m_ring.
+    pthread_mutex_t      m_mutex;
+    
+    const char          *m_configFile;
+    const char          *m_configOut;
     
     // This is a model of the real joystick - input events on the real device
     // are emitted as signals on the buttons & axes of this object.
-    boost::shared_ptr<InputJoystick> m_inputJoystick;
+    JoystickPtr                      m_inputJoystick;
     
     // This is the 'virtual' joystick. It attaches itself to m_inputJoystick
     // and presents a modified configuration of axes & buttons
-    boost::shared_ptr<Joystick>      m_outputJoystick;
+    MappedJoystickPtr                m_outputJoystick;
+    std::vector<boost::signals2::connection> m_outputConnections;
+    
+    // With --flat, this maps input events instead of m_inputJoystick's
+    // signals, and keeps the state of the virtual joystick.
+    boost::shared_ptr<FlatMapper>    m_flatMapper;
+    
+    // The mapping those belong to. Replaced with boost::atomic_store on
+    // reload, as ioctls use it without locking.
+    MappingPtr                       m_mapping;
+    
+    // Built from the changed config by reloadThread, for ioThread to switch
+    // to between batches of input. Guarded by m_mutex.
+    MappingPtr                       m_nextMapping;
+    
+    static MappingPtr BuildMapping(const std::vector<int> &fds,
+                            const std::vector<CorrectionTablePtr> &corrections,
+                            const char *configFile, const char *configOut);
     
     // Called by m_outputJoystick to output an event to the virtual joystick
     void AddEvent(__u32 time, __s16 value, __u8 type, bool init, __u8 number);
     
+    // Have all axes & buttons on m_outputJoystick call AddEvent
+    void ConnectOutputs();
+    
+    // The state of the virtual joystick, as JS_EVENT_INIT events
+    void OutputState(std::vector<js_event> &state) const;
+    
     // Process an individual input event on the real joystick
     void Input(const js_event &e);
     
-    // Read & process all input events from real joystick
-    void ReadAllInput();
+    // Feed the last event of each input (see JsInput::State) to the mapping
+    // as JS_EVENT_INIT, discarding what it outputs on the way. Must be called
+    // with m_mutex held.
+    void Replay(const std::vector<js_event> &inputState);
+    
+    // Publish m_batch in m_ring and apply it to m_state, having first replaced
+    // m_state with 'newState' if given. Must be called with m_mutex held.
+    void Publish(const std::vector<js_event> *newState = 0);
+    
+    // Tell files waiting for events that there are some. Must be called with
+    // m_mutex held.
+    void NotifyFiles();
+    
+public:
+    // The mapping in use. Hold on to it while using it: a reload may
+    // replace it at any time.
+    MappingPtr      GetMapping() { return boost::atomic_load(&m_mapping); }
+    __u32           Version()     { return m_input->Version(); }
+    const char     *ConfigFile() const { return m_configFile; }
+    const EventRing &Ring() const { return m_ring; }
+    
+    // Get the current state of the virtual joystick as JS_EVENT_INIT events in
+    // 'snapshot', and the position in Ring() at which that state applies in
+    // 'cursor'. Doesn't lock anything.
+    void Snapshot(__u32 &cursor, std::vector<js_event> &snapshot);
+    
+    // Start or stop delivering events to a JsFile. A newly attached file gets
+    // a Snapshot().
+    void Attach(JsFile *file, __u32 &cursor, std::vector<js_event> &snapshot);
+    void Detach(JsFile *file, const Histogram &queueLatency,
+                const Histogram &totalLatency);
+    
+    // Called by m_input when it attaches us: bring the mapping up to date
+    // with 'inputState', the last event of each input, as of 'time'
+    void Start(const std::vector<js_event> &inputState, __u32 time);
+    
+    // Called by ioThread with the events m_input has just read: map and
+    // publish them
+    void MapInput(const std::vector<JsInput::Incoming> &incoming);
+    
+    // Describe ourselves & our files for --stats. Called by ioThread.
+    void Stats(std::ostream &out);
+    
+    // Called by reloadThread when the config has changed: build a new
+    // mapping for ioThread to switch to
+    void Reload();
+    
+    // Called by ioThread: switch to the new mapping, if there is one, and
+    // send files the outputs that it changes
+    void SwitchMapping();
+    
+    // Called by ioThread before destroying us: hand our mappings to
+    // reloadThread to destroy, as saving calibration can make that slow
+    void RetireMappings();
+    
+    JsDevice(JsInputPtr input, const char *configFile, const char *configOut);
+    ~JsDevice();
+};
+
+// An object of this type represents an open descriptor on our cuse device. So
+// if two programs open the joystick simultaneously, we get two independent
+// JsFile objects, each with its own read position, fed by the same JsDevice.
+class JsFile
+{
+    JsDevicePtr           m_device;
+    pid_t                 m_pid;      // of the process that opened us
+    __u32                 m_cursor;   // next event wanted from device's ring
+    std::vector<js_event> m_snapshot; // to be sent before anything in ring
+    
+    // Times we've fallen more than g_params.queue events behind, and the
+    // number of events lost because of it
+    unsigned              m_overflows;
+    unsigned long         m_lost;
+    
+    // Requests received. m_ioctls is updated atomically, as ioctls don't
+    // lock anything.
+    unsigned long         m_reads;
+    unsigned long         m_polls;
+    volatile unsigned long m_ioctls;
+    std::vector<js_event> m_buf;      // for events copied out of the ring
+    std::vector<EventRing::Stamp> m_bufStamps;
+    
+    // Latency from events being published to being replied to a read, and
+    // from them being read from the real joystick to being replied. Guarded
+    // by m_mutex.
+    Histogram             m_queueLatency;
+    Histogram             m_totalLatency;
+    
+    // When the device coalesces axes, everything in the ring is moved here
+    // before being read. An axis has at most one live event in here: older
+    // ones are marked dead (type 0) when a newer one arrives. No more than
+    // g_params.queue are kept live, as for the ring.
+    std::vector<js_event> m_pending;
+    std::vector<EventRing::Stamp> m_pendingStamps;
+    size_t                m_pendingStart; // first unread event
+    size_t                m_pendingLive;  // unread events that aren't dead
+    std::vector<int>      m_axisPending;  // axis -> index in m_pending or -1
+    
+    // The device's mapping as of our last read, which decides whether we
+    // coalesce axes. Guarded by m_mutex.
+    MappingPtr            m_mapping;
+    
+    // Guards the members below, which ioThread only needs when m_waiting is
+    // set. Recursive because fuse may call read_interrupted from within
+    // fuse_req_interrupt_func.
+    pthread_mutex_t       m_mutex;
+    volatile int          m_waiting;  // WantInput(), readable without m_mutex
+    
+    // outstanding read request, for blocking reads
+    fuse_req_t            m_readReq;
+    size_t                m_readSize; // Size requested
+    
+    // used to inform fuse when input is available, if client is doing
+    // select/poll on our device
+    fuse_pollhandle      *m_pollHandle;
+    
+    bool HaveOutput() const;
+    
+    // Count an overflow, logging the first
+    void Overflowed();
+    
+    // Apply s_overflow if we've fallen too far behind. Done before each reply,
+    // and when stats are taken or we're closed, so that a reader which never
+    // reads again still has its losses counted.
+    void CheckOverflow();
+    
+    // Catch up with the device's mapping, if it has switched
+    void FollowMapping();
+    
+    // Move everything from the device's ring to m_pending, then TrimPending
+    void DrainRing();
+    // Apply s_overflow if m_pending has more than g_params.queue live events
+    void TrimPending();
+    // Copy up to 'max' live events from m_pending to m_buf (and their stamps
+    // to m_bufStamps)
+    size_t TakePending(size_t max);
+    
+    void RecordReply(const EventRing::Stamp &stamp, __u64 now)
+    {
+        m_queueLatency.Add(now - stamp.published);
+        m_totalLatency.Add(now - stamp.read);
+    }
     
     // Attempt to fulful outstanding read request on virtual joystick device
     bool AttemptOutput();
     
+    // Are we waiting for events from m_device?
+    bool WantInput() const { return m_readReq || m_pollHandle; }
+    void UpdateWaiting();
+    
     // Called by fuse when existing read request is interrupted
     void ReadInterrupted(fuse_req_t req);
     
     static void read_interrupted(fuse_req_t req, void *data);
     
 public:
-    Joystick &GetJoystick() { return *m_outputJoystick; }
-    __u32     Version()     { return m_version; }
-    int       InputFd()     { return m_fd; }
+    MappingPtr GetMapping() { return m_device->GetMapping(); }
+    __u32     Version()     { return m_device->Version(); }
     
     void Read(fuse_req_t req, size_t size, fuse_file_info *fi);
     void Poll(fuse_req_t req, struct fuse_pollhandle *ph);
     
-    // Called when data is available on input FD
-    void ReadAvailable();
+    // Called by ioThread when m_device has published more events
+    bool Waiting() const { return m_waiting; }
+    void OutputAvailable();
     
-    // Are we waiting for input to become available on input FD?
-    bool WantInput() const;
-
-    JsFile(const char *inputDev, const char *configFile, const char *configOut);
+    void CountIoctl() { __sync_fetch_and_add(&m_ioctls, 1); }
+    
+    // Describe ourselves for --stats
+    void Stats(std::ostream &out);
+    
+    JsFile(JsDevicePtr device, pid_t pid);
     ~JsFile();
     
 };
 typedef boost::shared_ptr<JsFile> JsFilePtr;
 
-JsFile::JsFile(const char *inputDev, const char *configFile,
-               const char *configOut)
-    : m_fd(-1),
-      m_version(0),
-      m_readReq(0),
-      m_pollHandle(0)
+JsInput::JsInput(const std::string &inputDev)
+    : m_version(0),
+      m_recordId(-1),
+      m_numButtons(0),
+      m_lastTime(0),
+      m_watched(false)
 {
-    m_fd = open(inputDev, O_RDONLY | O_NONBLOCK);
-    if (m_fd < 0)
-        throw std::runtime_error("Can't open input device");
+    std::istringstream devs(inputDev);
+    for (std::string dev; std::getline(devs, dev, ',');)
+        m_inputDevs.push_back(dev);
+    
+    unsigned numAxes = 0;
+    try {
+        for (unsigned i = 0; i < m_inputDevs.size(); ++i)
+        {
+            int fd = open(m_inputDevs[i].c_str(), O_RDONLY | O_NONBLOCK);
+            if (fd < 0)
+                throw std::runtime_error("Can't open input device " +
+                                         m_inputDevs[i]);
+            m_fds.push_back(fd);
+            m_corrections.push_back(
+                    CorrectionTablePtr(new CorrectionTable(fd)));
+            
+            __u8 buttons = 0, axes = 0;
+            ioctl(fd, JSIOCGBUTTONS, &buttons);
+            ioctl(fd, JSIOCGAXES,    &axes);
+            m_firstButton.push_back(m_numButtons);
+            m_firstAxis.push_back(numAxes);
+            m_numButtons += buttons;
+            numAxes += axes;
+        }
+        if (m_fds.empty())
+            throw std::runtime_error("no input device");
+        // Events still have to number every button & axis in a __u8
+        if (m_numButtons > 256 || numAxes > 256)
+            throw std::runtime_error("more than 256 buttons or axes to merge");
+    } catch (...) {
+        for (unsigned i = 0; i < m_fds.size(); ++i)
+            close(m_fds[i]);
+        throw;
+    }
+    ioctl(m_fds[0], JSIOCGVERSION, &m_version);
+    m_state.resize(m_numButtons + numAxes, js_event());
+    pthread_mutex_init(&m_mutex, NULL);
     
-    ioctl(m_fd, JSIOCGVERSION, &m_version);
+    // Events are recorded as the merged joystick's, so that they replay
+    // through the same config
+    if (s_recorder)
+        m_recordId = s_recorder->AddDevice(inputDev);
     
-    m_inputJoystick.reset(new InputJoystick(m_fd));
-    m_outputJoystick.reset(new MappedJoystick(m_inputJoystick,
-                                              configFile,
-                                              configOut));
+    // Pick up the real devices' startup events, so that the first device to
+    // attach gets a complete state
+    ReadAll();
+}
+
+// Is timestamp a after b? They're in ms, and wrap.
+static bool Later(__u32 a, __u32 b)
+{
+    return __s32(a - b) > 0;
+}
+
+void JsInput::ReadAll()
+{
+    // Our descriptors are non-blocking, so just read as much as we can. Each
+    // joystick's events arrive in time order, so inserting each one after
+    // any earlier events from the others puts them all in order. (Events
+    // still in the kernel can't be helped: a later read may find one that's
+    // older than what this one got.)
+    m_incoming.clear();
+    for (unsigned s = 0; s < m_fds.size(); ++s)
+    {
+        Incoming in;
+        while (m_fds[s] >= 0 &&
+               read(m_fds[s], &in.e, sizeof(in.e)) == sizeof(in.e))
+        {
+            in.read = MonotonicNs();
+            if ((in.e.type & ~JS_EVENT_INIT) == JS_EVENT_AXIS)
+                in.e.number += m_firstAxis[s];
+            else if ((in.e.type & ~JS_EVENT_INIT) == JS_EVENT_BUTTON)
+                in.e.number += m_firstButton[s];
+            
+            size_t pos = m_incoming.size();
+            m_incoming.push_back(in);
+            for (; pos > 0 && Later(m_incoming[pos - 1].e.time, in.e.time);
+                 --pos)
+                m_incoming[pos] = m_incoming[pos - 1];
+            m_incoming[pos] = in;
+        }
+    }
+    
+    for (unsigned i = 0; i < m_incoming.size(); ++i)
+    {
+        const Incoming &in = m_incoming[i];
+        if (s_recorder)
+            s_recorder->Record(m_recordId, in.read, in.e);
+        unsigned index = in.e.number;
+        if ((in.e.type & ~JS_EVENT_INIT) == JS_EVENT_AXIS)
+            index += m_numButtons;
+        else if ((in.e.type & ~JS_EVENT_INIT) != JS_EVENT_BUTTON)
+            index = m_state.size();
+        if (index < m_state.size())
+            m_state[index] = in.e;
+        m_lastTime = in.e.time;
+    }
+    if (s_recorder && !m_incoming.empty())
+        s_recorder->Flush();
+}
+
+std::vector<int> JsInput::Fds()
+{
+    Lock l(m_mutex);
+    return m_fds;
+}
+
+bool JsInput::Complete()
+{
+    Lock l(m_mutex);
+    return std::find(m_fds.begin(), m_fds.end(), -1) == m_fds.end();
+}
+
+void JsInput::Attach(JsDevice *device)
+{
+    Lock l(m_mutex);
+    device->Start(m_state, m_lastTime);
+    m_devices.push_back(device);
+    
+    // From now on ioThread does all the reading. Not before, so that nothing
+    // it might be reading can be destroyed under it by a device that fails
+    // to construct.
+    if (!m_watched)
+    {
+        epoll_event ev = epoll_event();
+        ev.events = EPOLLIN;
+        ev.data.ptr = this;
+        for (unsigned i = 0; i < m_fds.size(); ++i)
+            epoll_ctl(s_epollFd, EPOLL_CTL_ADD, m_fds[i], &ev);
+        m_watched = true;
+    }
+}
+
+void JsInput::Detach(JsDevice *device)
+{
+    Lock l(m_mutex);
+    m_devices.erase(std::remove(m_devices.begin(), m_devices.end(), device),
+                    m_devices.end());
+}
+
+void JsInput::ReadAvailable(unsigned events)
+{
+    Lock l(m_mutex);
+    
+    if (events & (EPOLLERR | EPOLLHUP))
+    {
+        // A real joystick has gone away. Stop watching it, or epoll will keep
+        // telling us about it, but carry on with any others.
+        for (unsigned i = 0; i < m_fds.size(); ++i)
+        {
+            pollfd p = { m_fds[i], POLLIN, 0 };
+            if (m_fds[i] < 0 || poll(&p, 1, 0) <= 0 ||
+                !(p.revents & (POLLERR | POLLHUP | POLLNVAL)))
+                continue;
+            std::cerr << "input device " << m_inputDevs[i] << " lost\n";
+            epoll_ctl(s_epollFd, EPOLL_CTL_DEL, m_fds[i], 0);
+            close(m_fds[i]);
+            m_fds[i] = -1;
+        }
+    }
+    
+    ReadAll();
+    if (m_incoming.empty())
+        return;
+    for (unsigned i = 0; i < m_devices.size(); ++i)
+        m_devices[i]->MapInput(m_incoming);
+}
+
+JsInput::~JsInput()
+{
+    for (unsigned i = 0; i < m_fds.size(); ++i)
+    {
+        if (m_fds[i] < 0)
+            continue;
+        if (m_watched)
+            epoll_ctl(s_epollFd, EPOLL_CTL_DEL, m_fds[i], 0);
+        close(m_fds[i]);
+    }
+    pthread_mutex_destroy(&m_mutex);
+}
+
+JsDevice::JsDevice(JsInputPtr input, const char *configFile,
+                   const char *configOut)
+    : m_input(input),
+      m_lastTime(0),
+      m_ring(g_params.queue),
+      m_stateHead(0),
+      m_stateTime(0),
+      m_stateSeq(0),
+      m_eventsIn(0),
+      m_users(0),
+      m_configFile(configFile),
+      m_configOut(configOut)
+{
+    MappingPtr mapping = BuildMapping(m_input->Fds(), m_input->Corrections(),
+                                      configFile, configOut);
+    m_mapping = mapping;
+    m_inputJoystick = mapping->input;
+    m_outputJoystick = mapping->output;
+    m_flatMapper = mapping->flat;
     
     pthread_mutex_init(&m_mutex, NULL);
     
+    const Joystick &joy = *m_outputJoystick;
+    m_buttonEvents.resize(joy.NumButtons());
+    m_axisEvents.resize(joy.NumAxes());
+    m_state.reserve(std::max(size_t(MAX_STATE),
+                             size_t(joy.NumButtons() + joy.NumAxes())));
     
-    // Have all axes & buttons on virtual joystick call AddEvent
-    using boost::bind;
-    for (unsigned i = 0; i < m_outputJoystick->NumButtons(); ++i)
+    ConnectOutputs();
+    
+    // Last, as from now on ioThread may call MapInput
+    m_input->Attach(this);
+}
+
+void JsDevice::Start(const std::vector<js_event> &inputState, __u32 time)
+{
+    Lock l(m_mutex);
+    Replay(inputState);
+    m_lastTime = time;
+    
+    // So that the first file to attach gets a complete snapshot
+    OutputState(m_state);
+    m_stateTime = m_lastTime;
+}
+
+MappingPtr JsDevice::BuildMapping(const std::vector<int> &fds,
+                            const std::vector<CorrectionTablePtr> &corrections,
+                            const char *configFile, const char *configOut)
+{
+    MappingPtr mapping(new Mapping());
+    if (fds.size() == 1)
+        mapping->input.reset(new InputJoystick(fds[0], 0, corrections[0]));
+    else
     {
-        m_outputJoystick->GetButton(i)->Connect(
-                bind(&JsFile::AddEvent, this,
-                      _1, _2, JS_EVENT_BUTTON, _3, i));
+        std::vector<JoystickPtr> parts;
+        unsigned order = 0;
+        for (unsigned i = 0; i < fds.size(); ++i)
+        {
+            parts.push_back(JoystickPtr(new InputJoystick(fds[i], order,
+                                                          corrections[i])));
+            order += parts.back()->NumButtons();
+        }
+        mapping->input.reset(new MergedJoystick(parts));
     }
-    for (unsigned i = 0; i < m_outputJoystick->NumAxes(); ++i)
+    
+    mapping->output = LoadMapping(mapping->input, configFile, configOut,
+                                  !g_params.nocache);
+    
+    if (g_params.flat || g_params.flatten)
     {
-        m_outputJoystick->GetAxis(i)->Connect(
-                bind(&JsFile::AddEvent, this,
-                     _1, _2, JS_EVENT_AXIS, _3, i));
+        MapTables tables;
+        mapping->output->Lower(tables);
+        mapping->flat.reset(new FlatMapper(tables,
+                                           mapping->input->NumButtons(),
+                                           mapping->input->NumAxes(),
+                                           g_params.flatten));
     }
+    mapping->Describe();
+    return mapping;
 }
 
-void JsFile::AddEvent(__u32 time, __s16 value, __u8 type, bool init,
-                       __u8 number)
+void Mapping::Describe()
+{
+    const Joystick &joy = *output;
+    name = joy.GetName();
+    if (!name.empty())
+        name.push_back('\0');
+    
+    numAxes = joy.NumAxes();
+    numButtons = joy.NumButtons();
+    coalesceAxes = output->CoalesceAxes();
+    corr.resize(joy.NumAxes());
+    memset(axisMap, 0, sizeof(axisMap));
+    memset(buttonMap, 0, sizeof(buttonMap));
+    for (unsigned i = 0; i < joy.NumAxes() && i < sizeof(axisMap); ++i)
+        axisMap[i] = joy.GetAxis(i)->GetMapping();
+    for (unsigned i = 0;
+         i < joy.NumButtons() && i < sizeof(buttonMap) / sizeof(__u16); ++i)
+        buttonMap[i] = joy.GetButton(i)->GetMapping();
+}
+
+void JsDevice::AddEvent(__u32 time, __s16 value, __u8 type, bool init,
+                        __u8 number)
 {
     js_event e = { time, value, type | (init ? JS_EVENT_INIT : 0), number };
-    m_events.push_back(e);
+    m_batch.push_back(e);
+}
+
+void JsDevice::ConnectOutputs()
+{
+    using boost::bind;
+    for (unsigned i = 0; !m_flatMapper && i < m_outputJoystick->NumButtons();
+         ++i)
+    {
+        m_outputConnections.push_back(m_outputJoystick->GetButton(i)->Connect(
+                bind(&JsDevice::AddEvent, this,
+                      _1, _2, JS_EVENT_BUTTON, _3, i)));
+    }
+    for (unsigned i = 0; !m_flatMapper && i < m_outputJoystick->NumAxes(); ++i)
+    {
+        m_outputConnections.push_back(m_outputJoystick->GetAxis(i)->Connect(
+                bind(&JsDevice::AddEvent, this,
+                     _1, _2, JS_EVENT_AXIS, _3, i)));
+    }
+}
+
+void JsDevice::OutputState(std::vector<js_event> &state) const
+{
+    const Joystick &joy = *m_outputJoystick;
+    state.clear();
+    for (unsigned i = 0; i < joy.NumButtons(); ++i)
+    {
+        __s16 value = m_flatMapper ? m_flatMapper->ButtonValue(i)
+                                   : joy.GetButton(i)->GetValue();
+        js_event e = { 0, value, JS_EVENT_BUTTON | JS_EVENT_INIT, __u8(i) };
+        state.push_back(e);
+    }
+    for (unsigned i = 0; i < joy.NumAxes(); ++i)
+    {
+        __s16 value = m_flatMapper ? m_flatMapper->AxisValue(i)
+                                   : joy.GetAxis(i)->GetValue();
+        js_event e = { 0, value, JS_EVENT_AXIS | JS_EVENT_INIT, __u8(i) };
+        state.push_back(e);
+    }
+}
+
+void JsDevice::Input(const js_event &e)
+{
+    bool init = e.type & JS_EVENT_INIT;
+    m_lastTime = e.time;
+    
+    if (m_flatMapper)
+    {
+        m_flatMapper->Input(e, m_batch);
+        return;
+    }
+    
+    switch (e.type & ~JS_EVENT_INIT)
+    {
+        case JS_EVENT_BUTTON:
+            if (e.number < m_inputJoystick->NumButtons())
+                m_inputJoystick->GetButton(e.number)->Input(
+                        e.time, e.value, init);
+            break;
+        case JS_EVENT_AXIS:
+            if (e.number < m_inputJoystick->NumAxes())
+                m_inputJoystick->GetAxis(e.number)->Input(
+                        e.time, e.value, init);
+            break;
+    }
+}
+
+void JsDevice::MapInput(const std::vector<JsInput::Incoming> &incoming)
+{
+    Lock l(m_mutex);
+    
+    // The events are in time order, so putting each one's output in order is
+    // enough to keep the whole batch in order
+    for (unsigned i = 0; i < incoming.size(); ++i)
+    {
+        EventRing::Stamp stamp = { incoming[i].read, 0, 0 };
+        ++m_eventsIn;
+        
+        const size_t frame = m_batch.size();
+        Input(incoming[i].e);
+        if (m_batch.size() - frame > 1)
+            SortFrame(&m_batch[frame], &m_batch[0] + m_batch.size());
+        
+        stamp.mapped = MonotonicNs();
+        m_mapLatency.Add(stamp.mapped - stamp.read);
+        m_batchStamps.resize(m_batch.size(), stamp);
+    }
+    
+    Publish();
+    NotifyFiles();
+}
+
+void JsDevice::Publish(const std::vector<js_event> *newState)
+{
+    if (m_batch.empty() && !newState)
+        return;
+    const __u64 now = MonotonicNs();
+    for (unsigned i = 0; i < m_batchStamps.size(); ++i)
+    {
+        m_batchStamps[i].published = now;
+        m_publishLatency.Add(now - m_batchStamps[i].mapped);
+    }
+    
+    ++m_stateSeq;
+    __sync_synchronize();
+    if (newState)
+        m_state.assign(newState->begin(), newState->end());
+    const unsigned numButtons = m_outputJoystick->NumButtons();
+    for (unsigned i = 0; i < m_batch.size(); ++i)
+    {
+        const js_event &e = m_batch[i];
+        unsigned index = e.number;
+        if ((e.type & ~JS_EVENT_INIT) == JS_EVENT_AXIS)
+        {
+            index += numButtons;
+            if (e.number < m_axisEvents.size())
+                ++m_axisEvents[e.number];
+        }
+        else if (e.number < m_buttonEvents.size())
+            ++m_buttonEvents[e.number];
+        if (index < m_state.size())
+            m_state[index].value = e.value;
+    }
+    m_stateTime = m_lastTime;
+    if (!m_batch.empty())
+        m_ring.Publish(&m_batch[0], m_batch.size(), &m_batchStamps[0]);
+    m_stateHead = m_ring.Head();
+    __sync_synchronize();
+    ++m_stateSeq;
+    
+    m_batch.clear();
+    m_batchStamps.clear();
+}
+
+void JsDevice::Snapshot(__u32 &cursor, std::vector<js_event> &snapshot)
+{
+    for (;;)
+    {
+        const unsigned seq = m_stateSeq;
+        __sync_synchronize();
+        if (seq & 1)
+            continue;
+        
+        snapshot.assign(m_state.begin(), m_state.end());
+        cursor = m_stateHead;
+        const __u32 time = m_stateTime;
+        __sync_synchronize();
+        if (m_stateSeq != seq)
+            continue;
+        
+        for (unsigned i = 0; i < snapshot.size(); ++i)
+            snapshot[i].time = time;
+        return;
+    }
+}
+
+void JsDevice::Attach(JsFile *file, __u32 &cursor,
+                      std::vector<js_event> &snapshot)
+{
+    // The file doesn't need to be told about new events until it's waiting
+    // for them, so there's no hurry to add it to m_files
+    Snapshot(cursor, snapshot);
+    
+    Lock l(m_mutex);
+    m_files.push_back(file);
+}
+
+void JsDevice::Detach(JsFile *file, const Histogram &queueLatency,
+                      const Histogram &totalLatency)
+{
+    Lock l(m_mutex);
+    m_files.erase(std::remove(m_files.begin(), m_files.end(), file),
+                  m_files.end());
+    m_closedQueueLatency.Merge(queueLatency);
+    m_closedTotalLatency.Merge(totalLatency);
+}
+
+void JsDevice::NotifyFiles()
+{
+    // Pairs with the barrier in JsFile::UpdateWaiting: either we see that a
+    // file is waiting, or it sees what we've just published
+    __sync_synchronize();
+    for (unsigned i = 0; i < m_files.size(); ++i)
+        if (m_files[i]->Waiting())
+            m_files[i]->OutputAvailable();
+}
+
+void JsDevice::Replay(const std::vector<js_event> &inputState)
+{
+    const __u32 lastTime = m_lastTime;
+    for (unsigned i = 0; i < inputState.size(); ++i)
+    {
+        js_event e = inputState[i];
+        e.type |= JS_EVENT_INIT;
+        if (inputState[i].type)
+            Input(e);
+    }
+    m_lastTime = lastTime;
+    m_batch.clear();
+}
+
+void JsDevice::Reload()
+{
+    // A new mapping needs every real joystick
+    std::vector<int> fds = m_input->Fds();
+    if (std::find(fds.begin(), fds.end(), -1) != fds.end())
+        return;
+    
+    MappingPtr mapping;
+    try {
+        mapping = BuildMapping(fds, m_input->Corrections(), m_configFile,
+                               m_configOut);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << ": keeping the old mapping\n";
+        return;
+    }
+    
+    {
+        Lock l(m_mutex);
+        m_nextMapping = mapping;
+    }
+    wakeup.Notify();
+}
+
+void JsDevice::SwitchMapping()
+{
+    const bool complete = m_input->Complete(); // before m_mutex: lock order
+    Lock l(m_mutex);
+    
+    MappingPtr next;
+    next.swap(m_nextMapping);
+    if (!next || !complete)
+        return;
+    const Joystick &joy = *next->output;
+    if (joy.NumButtons() + joy.NumAxes() > m_state.capacity())
+    {
+        std::cerr << "new mapping has too many outputs: not switching\n";
+        return;
+    }
+    
+    // Hand the old mapping to reloadThread to be destroyed. Readers that are
+    // still using it keep it alive until they're done.
+    for (unsigned i = 0; i < m_outputConnections.size(); ++i)
+        m_outputConnections[i].disconnect();
+    m_outputConnections.clear();
+    {
+        Lock retired(s_retiredMutex);
+        s_retired.push_back(m_mapping);
+    }
+    s_reloadWakeup.Notify();
+    
+    const unsigned oldButtons = m_buttonEvents.size();
+    const unsigned oldAxes = m_axisEvents.size();
+    m_inputJoystick = next->input;
+    m_outputJoystick = next->output;
+    m_flatMapper = next->flat;
+    boost::atomic_store(&m_mapping, next);
+    ConnectOutputs();
+    
+    // Bring the new mapping up to date with the real joystick. What it
+    // outputs on the way is only its own initial state.
+    Replay(m_input->State());
+    
+    // Resync files with every output that's new or has a new value
+    std::vector<js_event> state;
+    OutputState(state);
+    for (unsigned i = 0; i < state.size(); ++i)
+    {
+        const js_event &e = state[i];
+        unsigned old = e.number;
+        if ((e.type & ~JS_EVENT_INIT) == JS_EVENT_AXIS)
+            old = e.number < oldAxes ? oldButtons + e.number : m_state.size();
+        else if (e.number >= oldButtons)
+            old = m_state.size();
+        if (old < m_state.size() && m_state[old].value == e.value)
+            continue;
+        m_batch.push_back(e);
+        m_batch.back().time = m_lastTime;
+    }
+    m_buttonEvents.resize(joy.NumButtons());
+    m_axisEvents.resize(joy.NumAxes());
+    
+    const __u64 now = MonotonicNs();
+    EventRing::Stamp stamp = { now, now, 0 };
+    m_batchStamps.assign(m_batch.size(), stamp);
+    std::cerr << "switched to new mapping: " << m_batch.size()
+              << " outputs changed\n";
+    Publish(&state);
+    NotifyFiles();
+}
+
+// Print 'counts' as "0:12 1:3 ..."
+template <class T>
+static void StatsList(std::ostream &out, const char *what,
+                      const std::vector<T> &counts)
+{
+    out << "  " << what;
+    for (unsigned i = 0; i < counts.size(); ++i)
+        out << ' ' << i << ':' << counts[i];
+    out << '\n';
+}
+
+void JsDevice::Stats(std::ostream &out)
+{
+    Lock l(m_mutex);
+    
+    out << "  input";
+    for (unsigned i = 0; i < m_input->InputDevs().size(); ++i)
+        out << ' ' << m_input->InputDevs()[i];
+    out << "\n  config " << m_configFile << '\n';
+    
+    unsigned long long eventsOut = 0;
+    for (unsigned i = 0; i < m_buttonEvents.size(); ++i)
+        eventsOut += m_buttonEvents[i];
+    for (unsigned i = 0; i < m_axisEvents.size(); ++i)
+        eventsOut += m_axisEvents[i];
+    out << "  events in " << m_eventsIn << " out " << eventsOut << '\n';
+    StatsList(out, "button events", m_buttonEvents);
+    StatsList(out, "axis events", m_axisEvents);
+    
+    std::vector<unsigned long> switches;
+    if (m_flatMapper)
+    {
+        for (unsigned i = 0; i < m_flatMapper->NumShifts(); ++i)
+            switches.push_back(m_flatMapper->ShiftSwitches(i));
+    }
+    else
+        m_outputJoystick->ShiftSwitches(switches);
+    StatsList(out, "shift switches", switches);
+    
+    out << "  latency map     " << m_mapLatency.Summary() << '\n'
+        << "  latency publish " << m_publishLatency.Summary() << '\n';
+    if (m_closedTotalLatency.Count())
+        out << "  closed files: latency queue " 
+            << m_closedQueueLatency.Summary() << '\n'
+            << "                latency total "
+            << m_closedTotalLatency.Summary() << '\n';
+    
+    for (unsigned i = 0; i < m_files.size(); ++i)
+        m_files[i]->Stats(out);
+}
+
+void JsDevice::RetireMappings()
+{
+    Lock l(m_mutex);
+    for (unsigned i = 0; i < m_outputConnections.size(); ++i)
+        m_outputConnections[i].disconnect();
+    m_outputConnections.clear();
+    m_inputJoystick.reset();
+    m_outputJoystick.reset();
+    m_flatMapper.reset();
+    {
+        Lock retired(s_retiredMutex);
+        s_retired.push_back(m_mapping);
+        if (m_nextMapping)
+            s_retired.push_back(m_nextMapping);
+    }
+    boost::atomic_store(&m_mapping, MappingPtr());
+    m_nextMapping.reset();
+    s_reloadWakeup.Notify();
+}
+
+JsDevice::~JsDevice()
+{
+    m_input->Detach(this);
+    
+    if (m_closedTotalLatency.Count())
+    {
+        std::cerr << "latency: map "     << m_mapLatency.Summary()
+                  << "\n         publish " << m_publishLatency.Summary()
+                  << "\n         queue "   << m_closedQueueLatency.Summary()
+                  << "\n         total "   << m_closedTotalLatency.Summary()
+                  << '\n';
+    }
+}
+
+JsFile::JsFile(JsDevicePtr device, pid_t pid)
+    : m_device(device),
+      m_pid(pid),
+      m_cursor(0),
+      m_overflows(0),
+      m_lost(0),
+      m_reads(0),
+      m_polls(0),
+      m_ioctls(0),
+      m_pendingStart(0),
+      m_pendingLive(0),
+      m_waiting(0),
+      m_readReq(0),
+      m_pollHandle(0)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&m_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    
+    m_device->Attach(this, m_cursor, m_snapshot);
+    m_buf.resize(m_device->Ring().Capacity());
+    m_bufStamps.resize(m_buf.size());
+    FollowMapping();
+}
+
+void JsFile::FollowMapping()
+{
+    MappingPtr mapping = GetMapping();
+    if (mapping == m_mapping)
+        return;
+    m_mapping = mapping;
+    
+    // Events already pending are still sent (see AttemptOutput), but new
+    // ones aren't coalesced with them, as their axes may be numbered
+    // differently
+    m_axisPending.assign(m_mapping->coalesceAxes ? m_mapping->numAxes : 0,
+                         -1);
+}
+
+void JsFile::UpdateWaiting()
+{
+    m_waiting = WantInput();
+    __sync_synchronize();
+}
+
+bool JsFile::HaveOutput() const
+{
+    // The newest event in m_pending is never dead
+    return !m_snapshot.empty() || m_pendingStart < m_pending.size() ||
+           m_device->Ring().Available(m_cursor);
+}
+
+void JsFile::Overflowed()
+{
+    if (m_overflows++ == 0)
+        std::cerr << "reader " << m_pid << " is falling behind\n";
+}
+
+void JsFile::CheckOverflow()
+{
+    const EventRing &ring = m_device->Ring();
+    const __u32 backlog = ring.Head() - m_cursor;
+    if (backlog <= g_params.queue)
+        return;
+    
+    Overflowed();
+    
+    // Without its initial state, a reader needs the whole state anyway
+    OverflowPolicy policy = m_snapshot.empty() ? s_overflow : OVERFLOW_RESYNC;
+    if (policy == OVERFLOW_DROP)
+    {
+        m_lost += backlog - g_params.queue;
+        m_cursor += backlog - g_params.queue;
+        return;
+    }
+    
+    std::vector<js_event> state;
+    __u32 head;
+    m_device->Snapshot(head, state);
+    m_snapshot.clear();
+    if (policy == OVERFLOW_RESYNC)
+    {
+        m_lost += head - m_cursor;
+        m_snapshot.swap(state);
+        m_cursor = head;
+        return;
+    }
+    
+    // Coalesce: keep the button events from the last g_params.queue, then
+    // bring every axis up to date
+    __u32 cursor = head - g_params.queue;
+    m_lost += cursor - m_cursor;
+    while (__s32(head - cursor) > 0)
+    {
+        __u32 n = ring.Read(cursor, &m_buf[0],
+                            std::min(head - cursor, __u32(m_buf.size())));
+        for (__u32 i = 0; i < n; ++i)
+        {
+            if ((m_buf[i].type & ~JS_EVENT_INIT) == JS_EVENT_BUTTON)
+                m_snapshot.push_back(m_buf[i]);
+            else
+                ++m_lost;
+        }
+    }
+    for (unsigned i = 0; i < state.size(); ++i)
+    {
+        if ((state[i].type & ~JS_EVENT_INIT) == JS_EVENT_AXIS)
+        {
+            state[i].type &= ~JS_EVENT_INIT;
+            m_snapshot.push_back(state[i]);
+        }
+    }
+    m_cursor = head;
+}
+
+void JsFile::Stats(std::ostream &out)
+{
+    Lock l(m_mutex);
+    
+    // A reader that has stopped reading only overflows when we look
+    CheckOverflow();
+    
+    // No more of the ring's backlog than the overflow policy will keep
+    const __u32 backlog = m_device->Ring().Head() - m_cursor;
+    size_t queued = m_snapshot.size() + std::min(backlog, g_params.queue) +
+                    m_pendingLive;
+    
+    out << "  file (pid " << m_pid << "): queued " << queued
+        << " reads " << m_reads << " polls " << m_polls
+        << " ioctls " << m_ioctls << " overflows " << m_overflows
+        << " lost " << m_lost << '\n'
+        << "    latency queue " << m_queueLatency.Summary() << '\n'
+        << "    latency total " << m_totalLatency.Summary() << '\n';
 }
 
-void JsFile::Input(const js_event &e)
+void JsFile::DrainRing()
 {
-    bool init = e.type & JS_EVENT_INIT;
-    switch (e.type & ~JS_EVENT_INIT)
+    const EventRing &ring = m_device->Ring();
+    while (__u32 n = ring.Read(m_cursor, &m_buf[0], m_buf.size()))
     {
-        case JS_EVENT_BUTTON:
-            if (e.number < m_inputJoystick->NumButtons())
-                m_inputJoystick->GetButton(e.number)->Input(
-                        e.time, e.value, init);
-            break;
-        case JS_EVENT_AXIS:
-            if (e.number < m_inputJoystick->NumAxes())
-                m_inputJoystick->GetAxis(e.number)->Input(
-                        e.time, e.value, init);
-            break;
+        for (__u32 i = 0; i < n; ++i)
+        {
+            const js_event &e = m_buf[i];
+            m_pendingStamps.push_back(ring.StampAt(m_cursor - n + i));
+            if ((e.type & ~JS_EVENT_INIT) == JS_EVENT_AXIS &&
+                e.number < m_axisPending.size())
+            {
+                int &slot = m_axisPending[e.number];
+                if (slot >= 0)
+                {
+                    m_pending[slot].type = 0; // superseded
+                    --m_pendingLive;
+                }
+                slot = m_pending.size();
+            }
+            m_pending.push_back(e);
+            ++m_pendingLive;
+        }
     }
+    if (m_pendingLive > g_params.queue)
+        TrimPending();
 }
 
-void JsFile::ReadAllInput()
+void JsFile::TrimPending()
 {
-    // m_fd is non-blocking, so just read as much as we can
-    js_event event;
-    while (read(m_fd, &event, sizeof(event)) == sizeof(event))
-        Input(event);
+    Overflowed();
+    
+    if (s_overflow == OVERFLOW_RESYNC)
+    {
+        // Replace the lot with the whole state, stamped as the newest event
+        // that it takes account of
+        std::vector<js_event> state;
+        __u32 head;
+        m_device->Snapshot(head, state);
+        const EventRing::Stamp stamp = m_pendingStamps.back();
+        m_lost += m_pendingLive + (head - m_cursor);
+        m_cursor = head;
+        m_pending.swap(state);
+        m_pendingStamps.assign(m_pending.size(), stamp);
+        m_pendingStart = 0;
+        m_pendingLive = m_pending.size();
+        std::fill(m_axisPending.begin(), m_axisPending.end(), -1);
+        for (unsigned i = 0; i < m_pending.size(); ++i)
+        {
+            const js_event &e = m_pending[i];
+            if ((e.type & ~JS_EVENT_INIT) == JS_EVENT_AXIS &&
+                e.number < m_axisPending.size())
+                m_axisPending[e.number] = i;
+        }
+        return;
+    }
+    
+    // Kill the oldest events, but with coalesce, the button events first:
+    // the axis events are only the latest positions already
+    for (int pass = s_overflow == OVERFLOW_COALESCE ? 0 : 1;
+         pass < 2 && m_pendingLive > g_params.queue; ++pass)
+    {
+        for (size_t i = m_pendingStart;
+             i < m_pending.size() && m_pendingLive > g_params.queue; ++i)
+        {
+            js_event &e = m_pending[i];
+            const bool axis = (e.type & ~JS_EVENT_INIT) == JS_EVENT_AXIS;
+            if (e.type == 0 || (axis && pass == 0))
+                continue;
+            if (axis && e.number < m_axisPending.size() &&
+                m_axisPending[e.number] == int(i))
+                m_axisPending[e.number] = -1;
+            e.type = 0;
+            --m_pendingLive;
+            ++m_lost;
+        }
+    }
+    
+    // Keep the newest event live, as HaveOutput relies on
+    while (m_pending.size() > m_pendingStart && m_pending.back().type == 0)
+    {
+        m_pending.pop_back();
+        m_pendingStamps.pop_back();
+    }
 }
 
-bool JsFile::WantInput() const
+size_t JsFile::TakePending(size_t max)
 {
-    return m_readReq || m_pollHandle;
+    size_t n = 0;
+    for (; n < max && m_pendingStart < m_pending.size(); ++m_pendingStart)
+    {
+        const js_event &e = m_pending[m_pendingStart];
+        if (e.type == 0)
+            continue;
+        if ((e.type & ~JS_EVENT_INIT) == JS_EVENT_AXIS &&
+            e.number < m_axisPending.size() &&
+            m_axisPending[e.number] == int(m_pendingStart))
+        {
+            m_axisPending[e.number] = -1;
+        }
+        m_bufStamps[n] = m_pendingStamps[m_pendingStart];
+        m_buf[n++] = e;
+        --m_pendingLive;
+    }
+    
+    // Don't let read events pile up at the front
+    if (m_pendingStart == m_pending.size())
+    {
+        m_pending.clear();
+        m_pendingStamps.clear();
+        m_pendingStart = 0;
+    }
+    else if (m_pendingStart > m_pending.size() / 2)
+    {
+        m_pending.erase(m_pending.begin(),
+                        m_pending.begin() + m_pendingStart);
+        m_pendingStamps.erase(m_pendingStamps.begin(),
+                              m_pendingStamps.begin() + m_pendingStart);
+        for (unsigned i = 0; i < m_axisPending.size(); ++i)
+            if (m_axisPending[i] >= 0)
+                m_axisPending[i] -= m_pendingStart;
+        m_pendingStart = 0;
+    }
+    return n;
 }
 
-void JsFile::ReadAvailable()
+void JsFile::OutputAvailable()
 {
     Lock l(m_mutex);
-
-    ReadAllInput();
     
-    if (m_pollHandle && !m_events.empty())
+    if (m_pollHandle && HaveOutput())
     {
         fuse_notify_poll(m_pollHandle);
         fuse_pollhandle_destroy(m_pollHandle);
@@ -228,44 +1514,108 @@ void JsFile::ReadAvailable()
     {
         AttemptOutput();
     }
+    
+    UpdateWaiting();
 }
 
-struct EventOrder {
-    bool operator()(const js_event &a, const js_event &b) const {
-        if (a.time != b.time) return a.time < b.time;
-        if (a.type != b.type) return a.type < b.type;
-        if (a.number != b.number) return a.number < b.number;
-        return false;
-    }
-};
-
 bool JsFile::AttemptOutput()
 {
-    std::stable_sort(m_events.begin(), m_events.end(), EventOrder());
     assert(m_readReq);
+    FollowMapping();
+    CheckOverflow();
+    const EventRing &ring = m_device->Ring();
     size_t eventsWanted = m_readSize/sizeof(js_event);
-    size_t eventsToSend = std::min(eventsWanted, m_events.size());
-    if (eventsToSend > 0)
-    {
-        std::deque<js_event>::iterator i = m_events.begin() + eventsToSend;
-        // need events in a contiguous area of memory
-        std::vector<js_event> buf(m_events.begin(), i);
-        m_events.erase(m_events.begin(), i);
-        fuse_reply_buf(m_readReq, (char*)buf.data(),
-                       buf.size()*sizeof(js_event));
-        m_readReq = 0;
-        return true;
+    
+    // Reply straight from the snapshot & ring where we can
+    iovec iov[3];
+    int segs = 0;
+    size_t fromSnapshot = std::min(eventsWanted, m_snapshot.size());
+    if (fromSnapshot > 0)
+    {
+        iov[0].iov_base = &m_snapshot[0];
+        iov[0].iov_len = fromSnapshot * sizeof(js_event);
+        segs = 1;
+    }
+    
+    __u32 fromRing = 0, ringStart = 0;
+    int ringSegs = 0;
+    bool pendingStamps = false, peeked = false;
+    if (fromSnapshot < eventsWanted &&
+        (m_mapping->coalesceAxes || m_pendingStart < m_pending.size()))
+    {
+        // Only the newest value of each axis gets sent. If a reload has just
+        // turned that off, what's still pending goes before the ring.
+        if (m_mapping->coalesceAxes)
+            DrainRing();
+        fromRing = TakePending(std::min(eventsWanted - fromSnapshot,
+                                        m_buf.size()));
+        pendingStamps = true;
+        if (fromRing > 0)
+        {
+            iov[segs].iov_base = &m_buf[0];
+            iov[segs++].iov_len = fromRing * sizeof(js_event);
+        }
+    }
+    else if (fromSnapshot < eventsWanted)
+    {
+        fromRing = ring.Peek(m_cursor, eventsWanted - fromSnapshot,
+                             &iov[segs], ringSegs);
+        if (fromRing == 0)
+        {
+            // Too close to the writer (or nothing there): copy instead
+            fromRing = ring.Read(m_cursor, &m_buf[0],
+                                 std::min(eventsWanted - fromSnapshot,
+                                          m_buf.size()));
+            if (fromRing > 0)
+            {
+                iov[segs].iov_base = &m_buf[0];
+                iov[segs].iov_len = fromRing * sizeof(js_event);
+                ringSegs = 1;
+            }
+        }
+        else
+        {
+            m_cursor += fromRing;
+            peeked = true;
+        }
+        ringStart = m_cursor - fromRing;
+        segs += ringSegs;
+    }
+    
+    if (segs == 0)
+        return false;
+    
+    fuse_reply_iov(m_readReq, iov, segs);
+    
+    const __u64 now = MonotonicNs();
+    for (__u32 i = 0; i < fromRing; ++i)
+        RecordReply(pendingStamps ? m_bufStamps[i]
+                                  : ring.StampAt(ringStart + i), now);
+    
+    m_snapshot.erase(m_snapshot.begin(), m_snapshot.begin() + fromSnapshot);
+    m_readReq = 0;
+    
+    // If the writer lapped us while the reply was being sent straight from
+    // the ring, the client may have had torn events: count them as lost and
+    // resync it
+    if (peeked && ring.Overwritten(ringStart))
+    {
+        Overflowed();
+        __u32 head;
+        m_device->Snapshot(head, m_snapshot);
+        m_lost += fromRing + std::max(__s32(head - m_cursor), 0);
+        m_cursor = head;
     }
-    return false;
+    return true;
 }
 
 void JsFile::Read(fuse_req_t req, size_t size, fuse_file_info *fi)
 {
     Lock l(m_mutex);
+    ++m_reads;
     m_readReq = req;
     m_readSize = size;
     
-    ReadAllInput();
     if (AttemptOutput()) {
         return; // Success! Returned something at least.
     } else if (fi->flags & O_NONBLOCK) {
@@ -275,16 +1625,22 @@ void JsFile::Read(fuse_req_t req, size_t size, fuse_file_info *fi)
         return;
     }
     
+    // Have ioThread tell us about new events, then check we haven't just
+    // missed some
+    UpdateWaiting();
+    if (AttemptOutput()) {
+        UpdateWaiting();
+        return;
+    }
+    
     // Set fn to be called if this read is interrupted
     fuse_req_interrupt_func(req, &JsFile::read_interrupted, this);
-    
-    // Make sure IO thread has seen us
-    wakePipe.Notify();
 }
 
 void JsFile::Poll(fuse_req_t req, struct fuse_pollhandle *ph)
 {
     Lock l(m_mutex);
+    ++m_polls;
     
     if (ph)
     {
@@ -295,20 +1651,24 @@ void JsFile::Poll(fuse_req_t req, struct fuse_pollhandle *ph)
         m_pollHandle = ph;
     }
     
+    // fuse wants to know when more input is available
+    UpdateWaiting();
+    
     unsigned revents = 0;
-    if (!m_events.empty())
+    if (HaveOutput())
         revents |= POLLIN; // input available now
     
     fuse_reply_poll(req, revents);
-    
-    if (m_pollHandle)
-        wakePipe.Notify(); // fuse wants to know when more input is available
 }
 
 void JsFile::ReadInterrupted(fuse_req_t req)
 {
-    assert(req == m_readReq);
+    Lock l(m_mutex);
+    if (req != m_readReq)
+        return; // already answered
     fuse_reply_err(req, EINTR);
+    m_readReq = 0;
+    UpdateWaiting();
 }
 
 void JsFile::read_interrupted(fuse_req_t req, void *data)
@@ -318,53 +1678,333 @@ void JsFile::read_interrupted(fuse_req_t req, void *data)
 
 JsFile::~JsFile()
 {
-    if (m_fd >= 0)
-        close(m_fd);
+    CheckOverflow();
+    if (m_overflows)
+        std::cerr << "reader " << m_pid << " fell behind " << m_overflows
+                  << " times, losing " << m_lost << " events\n";
+    m_device->Detach(this, m_queueLatency, m_totalLatency);
+    
+    // Let go of the device before releasing it, so that ioThread, which
+    // destroys it once it has no users, holds the last reference
+    JsDevice *device = m_device.get();
+    m_device.reset();
+    ReleaseDevice(device);
+    pthread_mutex_destroy(&m_mutex);
 }
     
+// Open files by handle. The session loops may be running several threads,
+// so reads, polls & ioctls look their file up in whatever table is current,
+// without locking, and hold on to it for as long as they use it. Opens and
+// releases, which are rare, replace the table with an updated copy (using
+// boost::atomic_store), one at a time under s_fileHandlesMutex.
 typedef std::map<uint64_t, JsFilePtr> FileHandleMap;
-FileHandleMap s_fileHandles;
+typedef boost::shared_ptr<const FileHandleMap> FileHandleMapPtr;
+FileHandleMapPtr s_fileHandles(new FileHandleMap());
 pthread_mutex_t s_fileHandlesMutex = PTHREAD_MUTEX_INITIALIZER;
 
-void *select_threadproc(void *)
+// The file with handle 'fh', or null
+static JsFilePtr GetFile(uint64_t fh)
 {
-    fd_set fds;
-    const int wakeFd = wakePipe.WaitFd();
-    for (char exit = 'n'; exit != 'y';)
+    FileHandleMapPtr files = boost::atomic_load(&s_fileHandles);
+    FileHandleMap::const_iterator i = files->find(fh);
+    return i == files->end() ? JsFilePtr() : i->second;
+}
+
+// Virtual joysticks currently open, by VirtualDevice name, and the real
+// joysticks they read, by device path(s). Devices are only ever destroyed by
+// ioThread (in SweepDevices), and so are the inputs once nothing uses them,
+// so that it can safely use the pointers that epoll gives it.
+typedef std::map<std::string, JsDevicePtr> DeviceMap;
+typedef std::map<std::string, boost::weak_ptr<JsInput> > InputMap;
+DeviceMap s_devices;
+InputMap s_inputs;
+pthread_mutex_t s_devicesMutex = PTHREAD_MUTEX_INITIALIZER;
+
+JsDevicePtr GetDevice(const VirtualDevice &vd)
+{
+    Lock l(s_devicesMutex);
+    JsDevicePtr &device = s_devices[vd.name];
+    if (!device)
     {
-        FD_ZERO(&fds);
-        int maxfd = wakeFd;
-        FD_SET(wakeFd, &fds);
-        
-        Lock l(s_fileHandlesMutex);
-        for (FileHandleMap::const_iterator i = s_fileHandles.begin();
-             i != s_fileHandles.end(); ++i)
+        try {
+            // Virtual joysticks reading the same real ones share their input
+            JsInputPtr input = s_inputs[vd.indev].lock();
+            if (!input)
+            {
+                input.reset(new JsInput(vd.indev));
+                s_inputs[vd.indev] = input;
+            }
+            device.reset(new JsDevice(input, vd.configFile.c_str(),
+                                      vd.calibratedFile.empty() ? 0
+                                          : vd.calibratedFile.c_str()));
+        } catch (...) {
+            s_devices.erase(vd.name);
+            throw;
+        }
+    }
+    ++device->m_users;
+    return device;
+}
+
+// Called when a JsFile has finished with its device
+void ReleaseDevice(JsDevice *device)
+{
+    Lock l(s_devicesMutex);
+    if (--device->m_users == 0)
+        wakeup.Notify(); // have ioThread close it
+}
+
+// Close devices that nobody is using. Called by ioThread only. A device that
+// some other thread still holds on to (reloadThread, say) is left for a later
+// sweep: it must be destroyed here. Its mappings are left to reloadThread, if
+// there is one.
+void SweepDevices()
+{
+    Lock l(s_devicesMutex);
+    for (DeviceMap::iterator i = s_devices.begin(); i != s_devices.end();)
+    {
+        if (i->second->m_users == 0 && i->second.use_count() == 1)
+        {
+            if (s_reloading)
+                i->second->RetireMappings();
+            s_devices.erase(i++);
+        }
+        else
+            ++i;
+    }
+    for (InputMap::iterator i = s_inputs.begin(); i != s_inputs.end();)
+    {
+        if (i->second.expired())
+            s_inputs.erase(i++);
+        else
+            ++i;
+    }
+}
+
+// Switch devices to any new mappings that reloadThread has built for them.
+// Called by ioThread only.
+void SwitchMappings()
+{
+    Lock l(s_devicesMutex);
+    for (DeviceMap::iterator i = s_devices.begin(); i != s_devices.end(); ++i)
+        i->second->SwitchMapping();
+}
+
+// Send statistics for all devices to a client connecting to s_statsFd
+void ServeStats()
+{
+    int client = accept(s_statsFd, 0, 0);
+    if (client < 0)
+        return;
+    
+    std::ostringstream out;
+    {
+        Lock l(s_devicesMutex);
+        for (DeviceMap::iterator i = s_devices.begin(); i != s_devices.end();
+             ++i)
+        {
+            out << "device " << i->first << '\n';
+            i->second->Stats(out);
+        }
+    }
+    
+    // Never wait for the client: ioThread has better things to do
+    const std::string text = out.str();
+    send(client, text.data(), text.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client);
+}
+
+static int RunSession(VirtualDevice &vd)
+{
+    return vd.multithreaded ? fuse_session_loop_mt(vd.session)
+                            : fuse_session_loop(vd.session);
+}
+
+void *session_threadproc(void *data)
+{
+    RunSession(*(VirtualDevice *)data);
+    return 0;
+}
+
+// Ask the fuse session loops to finish
+void ExitSessions()
+{
+    for (unsigned i = 0; i < s_virtualDevices.size(); ++i)
+    {
+        VirtualDevice &vd = s_virtualDevices[i];
+        if (!vd.session || vd.thread == pthread_t())
+            continue;
+        fuse_session_exit(vd.session);
+        // The loop only notices once whatever it's blocked in is interrupted
+        pthread_kill(vd.thread, SIGUSR1);
+    }
+}
+
+static void interrupt_handler(int)
+{
+}
+
+void *io_threadproc(void *)
+{
+    epoll_event ev = epoll_event();
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wakeup;
+    epoll_ctl(s_epollFd, EPOLL_CTL_ADD, wakeup.WaitFd(), &ev);
+    ev.data.ptr = &s_signalFd;
+    epoll_ctl(s_epollFd, EPOLL_CTL_ADD, s_signalFd, &ev);
+    if (s_statsFd >= 0)
+    {
+        ev.data.ptr = &s_statsFd;
+        epoll_ctl(s_epollFd, EPOLL_CTL_ADD, s_statsFd, &ev);
+    }
+    
+    const int maxEvents = 16;
+    epoll_event events[maxEvents];
+    while (!wakeup.Exiting())
+    {
+        int n = epoll_wait(s_epollFd, events, maxEvents, -1);
+        bool woken = false;
+        for (int i = 0; i < n; ++i)
         {
-            if (i->second->WantInput()) {
-                int fd = i->second->InputFd();
-                FD_SET(fd, &fds);
-                maxfd = std::max(maxfd, fd);
+            void *ptr = events[i].data.ptr;
+            if (ptr == &wakeup)
+            {
+                wakeup.Consume();
+                woken = true;
+            }
+            else if (ptr == &s_signalFd)
+            {
+                signalfd_siginfo info;
+                if (read(s_signalFd, &info, sizeof(info)) == sizeof(info))
+                {
+                    std::cerr << "caught signal " << info.ssi_signo
+                              << ", exiting\n";
+                    ExitSessions();
+                }
             }
+            else if (ptr == &s_statsFd)
+                ServeStats();
+            else
+                ((JsInput*)ptr)->ReadAvailable(events[i].events);
         }
-        l.unlock();
-        
-        int sel = select(maxfd+1, &fds, 0, 0, 0);
-        
-        if (FD_ISSET(wakeFd, &fds))
+        // Not until we're done with 'events', which may point to an input
+        // that sweeping destroys
+        if (woken)
+        {
+            SweepDevices();
+            SwitchMappings();
+        }
+    }
+    return 0;
+}
+
+// Read everything inotify has for us, and add each of 'configs' that it
+// mentions to 'changed'. 'dirs' maps its watch descriptors to directories.
+static void ConfigsChanged(int fd, const std::map<int, std::string> &dirs,
+                           const std::set<std::string> &configs,
+                           std::set<std::string> &changed)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(inotify_event))));
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+    {
+        const inotify_event *e;
+        for (char *p = buf; p < buf + len; p += sizeof(*e) + e->len)
         {
-            read(wakeFd, &exit, 1);
+            e = (const inotify_event *)p;
+            std::map<int, std::string>::const_iterator dir = dirs.find(e->wd);
+            if (!e->len || dir == dirs.end())
+                continue;
+            const std::string path = dir->second + e->name;
+            if (configs.count(path))
+                changed.insert(path);
+        }
+    }
+}
+
+void *reload_threadproc(void *)
+{
+    // Watch the directories rather than the files: editors often save by
+    // replacing the file with a new one. Config paths are absolute by now.
+    std::set<std::string> configs;
+    for (unsigned i = 0; i < s_virtualDevices.size(); ++i)
+        configs.insert(s_virtualDevices[i].configFile);
+    
+    // Saving calibration to a config would otherwise reload it every time
+    for (unsigned i = 0; i < s_virtualDevices.size(); ++i)
+    {
+        const std::string &cal = s_virtualDevices[i].calibratedFile;
+        if (configs.erase(cal))
+            std::cerr << cal << " is also written with calibration: "
+                      << "not reloading it when it changes\n";
+    }
+    
+    std::map<int, std::string> dirs; // watch descriptor -> "dir/"
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    for (std::set<std::string>::const_iterator i = configs.begin();
+         i != configs.end(); ++i)
+    {
+        const std::string dir = i->substr(0, i->rfind('/') + 1);
+        int wd = fd < 0 ? -1 : inotify_add_watch(fd, dir.c_str(),
+                                                 IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd < 0)
+            std::cerr << "Can't watch " << *i << " for changes\n";
+        else
+            dirs[wd] = dir;
+    }
+    if (fd >= 0 && dirs.empty())
+    {
+        close(fd);
+        fd = -1;
+    }
+    
+    // poll ignores fds[1] if it's -1: we still destroy retired mappings
+    pollfd fds[2] = { { s_reloadWakeup.WaitFd(), POLLIN, 0 },
+                      { fd, POLLIN, 0 } };
+    while (!s_reloadWakeup.Exiting())
+    {
+        if (poll(fds, 2, -1) <= 0)
             continue;
+        if (fds[0].revents)
+        {
+            s_reloadWakeup.Consume();
+            std::vector<MappingPtr> retired;
+            {
+                Lock l(s_retiredMutex);
+                retired.swap(s_retired);
+            }
         }
+        std::set<std::string> changed;
+        if (fds[1].revents)
+            ConfigsChanged(fd, dirs, configs, changed);
+        if (changed.empty())
+            continue;
         
-        l.lock();
-        for (FileHandleMap::const_iterator i = s_fileHandles.begin();
-             i != s_fileHandles.end(); ++i)
+        // Saving may take more than one write: wait for it to finish
+        while (poll(&fds[1], 1, 200) > 0)
+            ConfigsChanged(fd, dirs, configs, changed);
+        
+        for (std::set<std::string>::const_iterator i = changed.begin();
+             i != changed.end(); ++i)
+            std::cerr << *i << " changed: reloading\n";
+        std::vector<JsDevicePtr> devices;
         {
-            int fd = i->second->InputFd();
-            if (fd <= maxfd && FD_ISSET(fd, &fds))
-                i->second->ReadAvailable();
+            Lock l(s_devicesMutex);
+            for (DeviceMap::iterator i = s_devices.begin();
+                 i != s_devices.end(); ++i)
+                if (changed.count(i->second->ConfigFile()))
+                    devices.push_back(i->second);
         }
+        for (unsigned i = 0; i < devices.size(); ++i)
+            devices[i]->Reload();
+        
+        // Any that were closed meanwhile were left for us to let go of
+        devices.clear();
+        wakeup.Notify();
     }
+    
+    if (fd >= 0)
+        close(fd);
     return 0;
 }
 
@@ -372,13 +2012,16 @@ void *select_threadproc(void *)
 static void stickshift_open(fuse_req_t req, struct fuse_file_info *fi)
 {
     try {
-        JsFilePtr joy(new JsFile(g_params.indev, g_params.configfile,
-                                 g_params.calibratedfile));
+        const VirtualDevice &vd = *(VirtualDevice *)fuse_req_userdata(req);
+        JsFilePtr joy(new JsFile(GetDevice(vd), fuse_req_ctx(req)->pid));
         Lock l(s_fileHandlesMutex);
-        while (s_fileHandles.find(fi->fh) != s_fileHandles.end())
+        boost::shared_ptr<FileHandleMap> files(
+                new FileHandleMap(*s_fileHandles));
+        while (files->find(fi->fh) != files->end())
             ++fi->fh;
         
-        s_fileHandles[fi->fh] = joy;
+        (*files)[fi->fh] = joy;
+        boost::atomic_store(&s_fileHandles, FileHandleMapPtr(files));
         fi->direct_io = 1; // lets us reply to reads with a short count
         fuse_reply_open(req, fi);
         return;
@@ -396,38 +2039,60 @@ static void stickshift_open(fuse_req_t req, struct fuse_file_info *fi)
 
 static void stickshift_release(fuse_req_t req, struct fuse_file_info *fi)
 {
-    Lock l(s_fileHandlesMutex);
-    bool ok = s_fileHandles.erase(fi->fh) > 0;
+    // The file is destroyed once the old table goes, and any request still
+    // using it has finished: not necessarily here
+    FileHandleMapPtr old;
+    bool ok = false;
+    {
+        Lock l(s_fileHandlesMutex);
+        old = s_fileHandles;
+        if (old->count(fi->fh))
+        {
+            boost::shared_ptr<FileHandleMap> files(new FileHandleMap(*old));
+            files->erase(fi->fh);
+            boost::atomic_store(&s_fileHandles, FileHandleMapPtr(files));
+            ok = true;
+        }
+    }
     fuse_reply_err(req, ok ? 0 : EINVAL);
 }
 
 static void stickshift_read(fuse_req_t req, size_t size, off_t off,
                          struct fuse_file_info *fi)
 {
-    s_fileHandles[fi->fh]->Read(req, size, fi);
+    if (JsFilePtr file = GetFile(fi->fh))
+        file->Read(req, size, fi);
+    else
+        fuse_reply_err(req, EBADF);
 }
 
 static void stickshift_ioctl(fuse_req_t req, int cmd, void *arg,
                           struct fuse_file_info *fi, unsigned flags,
                           const void *in_buf, size_t in_bufsz, size_t out_bufsz)
 {
-    JsFile &file = *s_fileHandles[fi->fh];
-    Joystick &joy = file.GetJoystick();
+    JsFilePtr filePtr = GetFile(fi->fh);
+    if (!filePtr)
+    {
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+    JsFile &file = *filePtr;
+    MappingPtr mapping = file.GetMapping();
+    Mapping &m = *mapping;
+    Joystick &joy = *m.output;
+    file.CountIoctl();
     
     unsigned cmdsize = _IOC_SIZE(cmd);
     switch (cmd & ~IOCSIZE_MASK)
     {
-    case JSIOCGNAME(0): {
-        std::string name = joy.GetName();
-        size_t len = name.empty() ? 0 : name.size()+1;
+    case JSIOCGNAME(0):
         if (!out_bufsz) {
-            struct iovec iov = { arg, len };
+            struct iovec iov = { arg, m.name.size() };
             fuse_reply_ioctl_retry(req, NULL, 0, &iov, 1);
         } else {
-            fuse_reply_ioctl(req, 0, name.c_str(), len);
+            fuse_reply_ioctl(req, 0, m.name.data(), m.name.size());
         }
         break;
-    }
     case (JSIOCGVERSION & ~IOCSIZE_MASK):
         if (!out_bufsz) {
             struct iovec iov = { arg, sizeof(__u32) };
@@ -442,8 +2107,7 @@ static void stickshift_ioctl(fuse_req_t req, int cmd, void *arg,
             struct iovec iov = { arg, sizeof(__u8) };
             fuse_reply_ioctl_retry(req, NULL, 0, &iov, 1);
         } else {
-            __u8 axes = joy.NumAxes();
-            fuse_reply_ioctl(req, 0, &axes, sizeof(__u8));
+            fuse_reply_ioctl(req, 0, &m.numAxes, sizeof(__u8));
         }
         break;
     case (JSIOCGBUTTONS & ~IOCSIZE_MASK):
@@ -451,8 +2115,7 @@ static void stickshift_ioctl(fuse_req_t req, int cmd, void *arg,
             struct iovec iov = { arg, sizeof(__u8) };
             fuse_reply_ioctl_retry(req, NULL, 0, &iov, 1);
         } else {
-            __u8 buttons = joy.NumButtons();
-            fuse_reply_ioctl(req, 0, &buttons, sizeof(__u8));
+            fuse_reply_ioctl(req, 0, &m.numButtons, sizeof(__u8));
         }
         break;
     case (JSIOCGAXMAP & ~IOCSIZE_MASK):
@@ -460,13 +2123,8 @@ static void stickshift_ioctl(fuse_req_t req, int cmd, void *arg,
             struct iovec iov = { arg, cmdsize };
             fuse_reply_ioctl_retry(req, NULL, 0, &iov, 1);
         } else {
-            unsigned entries = cmdsize;
-            __u8 map[entries];
-            int toFill = std::min(entries, joy.NumAxes());
-            
-            for (unsigned i = 0; i < toFill; ++i)
-                map[i] = joy.GetAxis(i)->GetMapping();
-            fuse_reply_ioctl(req, 0, map, cmdsize);
+            fuse_reply_ioctl(req, 0, m.axisMap,
+                             std::min(size_t(cmdsize), sizeof(m.axisMap)));
         }
         break;
     case (JSIOCGBTNMAP & ~IOCSIZE_MASK):
@@ -474,32 +2132,27 @@ static void stickshift_ioctl(fuse_req_t req, int cmd, void *arg,
             struct iovec iov = { arg, cmdsize };
             fuse_reply_ioctl_retry(req, NULL, 0, &iov, 1);
         } else {
-            unsigned entries = cmdsize/sizeof(__u16);
-            __u16 map[entries];
-            unsigned toFill = std::min(entries, joy.NumButtons());
-            
-            for (unsigned i = 0; i < toFill; ++i)
-                map[i] = joy.GetButton(i)->GetMapping();
-            
-            fuse_reply_ioctl(req, 0, map, cmdsize);
+            fuse_reply_ioctl(req, 0, m.buttonMap,
+                             std::min(size_t(cmdsize), sizeof(m.buttonMap)));
         }
         break;
     case (JSIOCGCORR & ~IOCSIZE_MASK): {
-        size_t len = joy.NumAxes() * sizeof(js_corr);
-        if (!out_bufsz || out_bufsz < len) {
+        size_t len = m.corr.size() * sizeof(js_corr);
+        if (!len) {
+            fuse_reply_ioctl(req, 0, 0, 0); // no axes: nothing to retry for
+        } else if (!out_bufsz || out_bufsz < len) {
             struct iovec iov = { arg, len };
             fuse_reply_ioctl_retry(req, NULL, 0, &iov, 1);
         } else {
-            js_corr *j = new js_corr[joy.NumAxes()];
-            joy.GetCorrection(j);
-            fuse_reply_ioctl(req, 0, j, len);
-            delete [] j;
+            Lock l(m.corrMutex);
+            joy.GetCorrection(&m.corr[0]);
+            fuse_reply_ioctl(req, 0, &m.corr[0], len);
         }
        break;
     }
     case (JSIOCSCORR & ~IOCSIZE_MASK): {
         size_t len = joy.NumAxes() * sizeof(js_corr);
-        if (!in_bufsz || in_bufsz < len) {
+        if (len && (!in_bufsz || in_bufsz < len)) {
             struct iovec iov = { arg, len };
             fuse_reply_ioctl_retry(req, &iov, 1, NULL, 0);
         } else {
@@ -518,42 +2171,127 @@ static void stickshift_ioctl(fuse_req_t req, int cmd, void *arg,
 static void stickshift_poll(fuse_req_t req, struct fuse_file_info *fi,
                          struct fuse_pollhandle *ph)
 {
-    s_fileHandles[fi->fh]->Poll(req, ph);
+    if (JsFilePtr file = GetFile(fi->fh))
+        file->Poll(req, ph);
+    else
+    {
+        if (ph)
+            fuse_pollhandle_destroy(ph);
+        fuse_reply_err(req, EBADF);
+    }
+}
+
+// Listen on the --stats socket
+int StatsSocket(const char *path)
+{
+    sockaddr_un addr = sockaddr_un();
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    unlink(path); // left over from last time
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
 }
 
 void stickshift_init(void *userdata, struct fuse_conn_info *conn)
 {
+    Lock l(s_sessionsMutex);
+    if (s_sessionsUp++)
+        return;
+    
     LIBXML_TEST_VERSION
-    if (pthread_create(&selectThread, NULL, &select_threadproc, 0) != 0)
+    s_epollFd = epoll_create(16);
+    s_signalFd = signalfd(-1, &s_exitSignals, SFD_NONBLOCK);
+    if (g_params.stats && (s_statsFd = StatsSocket(g_params.stats)) < 0)
+        std::cerr << "Can't listen on " << g_params.stats << '\n';
+    if (g_params.record)
+    {
+        try {
+            s_recorder = new Recorder(g_params.record);
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << ": " << g_params.record << '\n';
+            exit(1);
+        }
+    }
+    if (s_epollFd < 0 || s_signalFd < 0 ||
+        pthread_create(&ioThread, NULL, &io_threadproc, 0) != 0)
     {
         std::cerr << "Can't create thread\n";
         exit(1);
     }
+    if (!g_params.noreload)
+    {
+        s_reloading = pthread_create(&s_reloadThread, NULL,
+                                     &reload_threadproc, 0) == 0;
+        if (!s_reloading)
+            std::cerr << "Can't create thread: config won't be reloaded\n";
+    }
 }
 
 void stickshift_destroy(void *userdata)
 {
-    wakePipe.Exit();
-    pthread_join(selectThread, 0);
+    Lock l(s_sessionsMutex);
+    if (--s_sessionsUp)
+        return;
+    
+    if (s_reloading)
+    {
+        s_reloadWakeup.Exit();
+        pthread_join(s_reloadThread, 0);
+    }
+    wakeup.Exit();
+    pthread_join(ioThread, 0);
+    s_retired.clear();  // any left after reloadThread finished
+    if (s_statsFd >= 0)
+    {
+        close(s_statsFd);
+        unlink(g_params.stats);
+    }
+    delete s_recorder;  // writes out whatever's left
+    s_recorder = 0;
     xmlCleanupParser();
 }
 
 #define SSHIFT_OPT(t, p) { t, offsetof(struct stickshift_param, p), 1 }
 
+enum { OPT_KEY_HELP, OPT_KEY_INDEV, OPT_KEY_ALSO };
+
+// Every -I and --also given, in order
+static std::vector<std::string> s_inputDevs;
+static std::vector<std::string> s_also;
+
 static const struct fuse_opt stickshift_opts[] = {
         SSHIFT_OPT("-M %u",             major),
         SSHIFT_OPT("--maj=%u",          major),
         SSHIFT_OPT("-m %u",             minor),
         SSHIFT_OPT("--min=%u",          minor),
-        SSHIFT_OPT("-I %s",             indev),
-        SSHIFT_OPT("--indev=%s",        indev),
+        FUSE_OPT_KEY("-I ",             OPT_KEY_INDEV),
+        FUSE_OPT_KEY("--indev=",        OPT_KEY_INDEV),
         SSHIFT_OPT("-O %s",             outdev),
         SSHIFT_OPT("--outdev=%s",       outdev),
         SSHIFT_OPT("-c %s",             configfile),
         SSHIFT_OPT("--config=%s",       configfile),
         SSHIFT_OPT("--calibrated=%s",   calibratedfile),
-        FUSE_OPT_KEY("-h",              0),
-        FUSE_OPT_KEY("--help",          0),
+        SSHIFT_OPT("--nocache",         nocache),
+        SSHIFT_OPT("--noreload",        noreload),
+        SSHIFT_OPT("--flat",            flat),
+        SSHIFT_OPT("--flatten",         flatten),
+        SSHIFT_OPT("--queue=%u",        queue),
+        SSHIFT_OPT("--overflow=%s",     overflow),
+        SSHIFT_OPT("--stats=%s",        stats),
+        SSHIFT_OPT("--record=%s",       record),
+        FUSE_OPT_KEY("--also=",         OPT_KEY_ALSO),
+        FUSE_OPT_KEY("-h",              OPT_KEY_HELP),
+        FUSE_OPT_KEY("--help",          OPT_KEY_HELP),
         {0, 0, 0}
 };
 
@@ -563,14 +2301,21 @@ static int stickshift_process_arg(void *data, const char *arg, int key,
     struct stickshift_param *param = (stickshift_param*)data;
 
     (void)outargs;
-    (void)arg;
 
     switch (key)
     {
-    case 0:
+    case OPT_KEY_HELP:
         param->is_help = 1;
         std::cerr << usage;
         return fuse_opt_add_arg(outargs, "-ho");
+    case OPT_KEY_INDEV:
+        // arg is "-IDEV" or "--indev=DEV"
+        s_inputDevs.push_back(strncmp(arg, "--", 2) ? arg + 2
+                                                    : arg + strlen("--indev="));
+        return 0;
+    case OPT_KEY_ALSO:
+        s_also.push_back(arg + strlen("--also="));
+        return 0;
     default:
         return 1;
     }
@@ -583,6 +2328,7 @@ int main(int argc, char **argv)
     struct cuse_lowlevel_ops stickshift_clop = cuse_lowlevel_ops();
     struct cuse_info ci = cuse_info();
     g_params.major = g_params.minor = -1;
+    g_params.queue = 4096;
     
     char *pcwd = get_current_dir_name();
     string cwd(pcwd);
@@ -598,6 +2344,14 @@ int main(int argc, char **argv)
     if (g_params.is_help)
         goto help_fast_exit;
 
+    // Several input devices are passed around as one comma-separated list
+    if (!s_inputDevs.empty())
+    {
+        static string indevs;
+        for (unsigned i = 0; i < s_inputDevs.size(); ++i)
+            indevs += (i ? "," : "") + s_inputDevs[i];
+        g_params.indev = indevs.c_str();
+    }
     if (!(g_params.indev))
     {
         cerr << "no input joystick device specified\n";
@@ -608,6 +2362,25 @@ int main(int argc, char **argv)
         cerr << "no config file specified\n";
         return 1;
     }
+    if (g_params.queue == 0 || g_params.queue > 1u << 24)
+    {
+        cerr << "queue length should be between 1 and " << (1u << 24) << "\n";
+        return 1;
+    }
+    if (g_params.overflow)
+    {
+        if (!strcmp(g_params.overflow, "drop"))
+            s_overflow = OVERFLOW_DROP;
+        else if (!strcmp(g_params.overflow, "coalesce"))
+            s_overflow = OVERFLOW_COALESCE;
+        else if (!strcmp(g_params.overflow, "resync"))
+            s_overflow = OVERFLOW_RESYNC;
+        else
+        {
+            cerr << "unknown overflow policy " << g_params.overflow << "\n";
+            return 1;
+        }
+    }
     
     // When not running in debug mode ('-d'), the CWD gets set to '/' after
     // we're initialised. Convert relative paths to absolute ones.
@@ -621,6 +2394,16 @@ int main(int argc, char **argv)
         static string absCal = cwd + '/' + g_params.calibratedfile;
         g_params.calibratedfile = absCal.c_str();
     }
+    if (g_params.stats && g_params.stats[0] != '/')
+    {
+        static string absStats = cwd + '/' + g_params.stats;
+        g_params.stats = absStats.c_str();
+    }
+    if (g_params.record && g_params.record[0] != '/')
+    {
+        static string absRecord = cwd + '/' + g_params.record;
+        g_params.record = absRecord.c_str();
+    }
     
     if ((g_params.major < 0 || g_params.minor < 0) && g_params.outdev)
     {
@@ -647,6 +2430,65 @@ int main(int argc, char **argv)
         return 1;
     }
     
+    {
+        VirtualDevice vd;
+        vd.devMinor = g_params.minor;
+        vd.indev = g_params.indev;
+        vd.configFile = g_params.configfile;
+        if (g_params.calibratedfile)
+            vd.calibratedFile = g_params.calibratedfile;
+        s_virtualDevices.push_back(vd);
+    }
+    for (unsigned i = 0; i < s_also.size(); ++i)
+    {
+        // MIN:CFG[:DEVS[:CAL]]
+        const string &spec = s_also[i];
+        vector<string> fields;
+        istringstream parts(spec);
+        for (string field; getline(parts, field, ':');)
+            fields.push_back(field);
+        if (!spec.empty() && spec[spec.size() - 1] == ':')
+            fields.push_back("");
+        
+        char *end = 0;
+        VirtualDevice vd;
+        if (fields.size() >= 2 && fields.size() <= 4)
+        {
+            vd.devMinor = strtoul(fields[0].c_str(), &end, 10);
+            vd.configFile = fields[1];
+            vd.indev = fields.size() > 2 && !fields[2].empty() ? fields[2]
+                                                               : g_params.indev;
+            if (fields.size() > 3)
+                vd.calibratedFile = fields[3];
+        }
+        if (fields.size() < 2 || fields.size() > 4 || fields[0].empty() ||
+            *end || vd.configFile.empty() ||
+            (fields.size() > 3 && vd.calibratedFile.empty()))
+        {
+            cerr << "--also should be MIN:CFG[:DEVS[:CAL]], not " << spec
+                 << "\n";
+            return 1;
+        }
+        if (vd.configFile[0] != '/')
+            vd.configFile = cwd + '/' + vd.configFile;
+        if (!vd.calibratedFile.empty() && vd.calibratedFile[0] != '/')
+            vd.calibratedFile = cwd + '/' + vd.calibratedFile;
+        s_virtualDevices.push_back(vd);
+    }
+    for (unsigned i = 0; i < s_virtualDevices.size(); ++i)
+    {
+        VirtualDevice &vd = s_virtualDevices[i];
+        vd.name = str(boost::format("stickshift%s") % vd.devMinor);
+        for (unsigned j = 0; j < i; ++j)
+        {
+            if (s_virtualDevices[j].devMinor == vd.devMinor)
+            {
+                cerr << "minor number " << vd.devMinor << " used twice\n";
+                return 1;
+            }
+        }
+    }
+    
     stickshift_clop.open    = stickshift_open;
     stickshift_clop.release = stickshift_release;
     stickshift_clop.read    = stickshift_read;
@@ -657,16 +2499,86 @@ int main(int argc, char **argv)
 
 help_fast_exit:
     
-    string dev_name = str(boost::format("DEVNAME=stickshift%s")
-                            % g_params.minor);
-    
-    const char *dev_info_argv[] = { dev_name.c_str() };
-    ci.dev_major = g_params.major;
-    ci.dev_minor = g_params.minor;
-    ci.dev_info_argc = 1;
-    ci.dev_info_argv = dev_info_argv;
-    ci.flags = CUSE_UNRESTRICTED_IOCTL;
+    // With --help, fuse just describes its own options
+    if (s_virtualDevices.empty())
+    {
+        s_virtualDevices.push_back(VirtualDevice());
+        s_virtualDevices.back().name = "stickshift";
+    }
 
-    return cuse_lowlevel_main(args.argc, args.argv, &ci, &stickshift_clop,
-                              NULL);
+    // Block the exit signals before any other thread is started, so that they
+    // all inherit the mask and the signals only arrive through s_signalFd.
+    sigemptyset(&s_exitSignals);
+    sigaddset(&s_exitSignals, SIGHUP);
+    sigaddset(&s_exitSignals, SIGINT);
+    sigaddset(&s_exitSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &s_exitSignals, 0);
+    
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = interrupt_handler; // no SA_RESTART: we want EINTR
+    sigaction(SIGUSR1, &sa, 0);
+    
+    // This is cuse_lowlevel_main(), but for each virtual device, keeping hold
+    // of the sessions
+    unsigned numSessions = 0;
+    for (; numSessions < s_virtualDevices.size(); ++numSessions)
+    {
+        VirtualDevice &vd = s_virtualDevices[numSessions];
+        string dev_name = "DEVNAME=" + vd.name;
+        const char *dev_info_argv[] = { dev_name.c_str() };
+        ci.dev_major = g_params.major;
+        ci.dev_minor = vd.devMinor;
+        ci.dev_info_argc = 1;
+        ci.dev_info_argv = dev_info_argv;
+        ci.flags = CUSE_UNRESTRICTED_IOCTL;
+        
+        // Only the first may go into the background: the rest are set up in
+        // the process that that leaves running
+        fuse_args sessionArgs = FUSE_ARGS_INIT(0, 0);
+        for (int i = 0; i < args.argc; ++i)
+            fuse_opt_add_arg(&sessionArgs, args.argv[i]);
+        if (numSessions)
+            fuse_opt_add_arg(&sessionArgs, "-f");
+        vd.session = cuse_lowlevel_setup(sessionArgs.argc, sessionArgs.argv,
+                                         &ci, &stickshift_clop,
+                                         &vd.multithreaded, &vd);
+        fuse_opt_free_args(&sessionArgs);
+        if (!vd.session)
+            break;
+    }
+    
+    int res = -1;
+    if (numSessions == s_virtualDevices.size())
+    {
+        // Each session after the first gets a thread of its own
+        s_virtualDevices[0].thread = pthread_self();
+        for (unsigned i = 1; i < numSessions; ++i)
+        {
+            VirtualDevice &vd = s_virtualDevices[i];
+            if (pthread_create(&vd.thread, NULL, &session_threadproc, &vd))
+            {
+                cerr << "Can't create thread for " << vd.name << "\n";
+                fuse_session_exit(vd.session);
+                vd.thread = pthread_t();
+            }
+        }
+        res = RunSession(s_virtualDevices[0]);
+        
+        // When the first session ends, they all do
+        ExitSessions();
+        for (unsigned i = 1; i < numSessions; ++i)
+            if (s_virtualDevices[i].thread != pthread_t())
+                pthread_join(s_virtualDevices[i].thread, 0);
+    }
+    
+    for (unsigned i = numSessions; i-- > 0;)
+    {
+        // Teardown removes fuse's signal handlers, which it only does for
+        // the session that installed them last
+        fuse_set_signal_handlers(s_virtualDevices[i].session);
+        cuse_lowlevel_teardown(s_virtualDevices[i].session);
+    }
+    
+    return res == -1 ? 1 : 0;
 }
@@ -0,0 +1,61 @@
+/* (c) Peter Chapman 2010
+   Licensed under the GNU General Public Licence; either version 2 or (at your
+   option) any later version
+*/
+#include "wakeup.h"
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <unistd.h>
+
+Wakeup::Wakeup()
+    : m_fd(eventfd(0, EFD_NONBLOCK)),
+      m_pending(0),
+      m_exit(0)
+{
+}
+
+
+Wakeup::~Wakeup()
+{
+    close(m_fd);
+}
+
+
+int Wakeup::WaitFd()
+{
+    return m_fd;
+}
+
+
+void Wakeup::Notify()
+{
+    // Only the first notification since the last Consume() needs a syscall
+    if (__sync_fetch_and_or(&m_pending, 1) == 0)
+    {
+        uint64_t one = 1;
+        write(m_fd, &one, sizeof(one));
+    }
+}
+
+void Wakeup::Consume()
+{
+    // Drain the eventfd before clearing the flag, so that a Notify() which
+    // sees the flag clear always writes again and the write isn't swallowed
+    // here. Both sides use full barriers so the caller's work after
+    // Consume() sees whatever was published before a skipped write.
+    uint64_t count;
+    read(m_fd, &count, sizeof(count));
+    __sync_fetch_and_and(&m_pending, 0);
+}
+
+void Wakeup::Exit()
+{
+    __sync_lock_test_and_set(&m_exit, 1);
+    uint64_t one = 1;
+    write(m_fd, &one, sizeof(one));
+}
+
+bool Wakeup::Exiting() const
+{
+    return m_exit;
+}
@@ -0,0 +1,31 @@
+#if !defined(INCLUDED_WAKEUP_H_)
+#define INCLUDED_WAKEUP_H_
+
+/* (c) Peter Chapman 2010
+   Licensed under the GNU General Public Licence; either version 2 or (at your
+   option) any later version
+*/
+
+// Wakes a thread that is waiting on WaitFd(). Any number of notifications
+// made before the waiting thread gets round to calling Consume() are merged
+// into one.
+class Wakeup
+{
+    int          m_fd;       // eventfd
+    volatile int m_pending;  // notified since last Consume()?
+    volatile int m_exit;
+
+public:
+    Wakeup();
+    ~Wakeup();
+
+    int WaitFd();
+    void Notify();
+    void Consume();
+
+    // Ask the waiting thread to finish
+    void Exit();
+    bool Exiting() const;
+};
+
+#endif